@@ -30,17 +30,23 @@ from sparkplug_b import *
 
 # Application constants
 APP_VERSION             = '1.0'
-COMMS_VERSION           = 2
+COMMS_VERSION           = 12
 COMMS_VERSION_METRIC    = 'Properties/Communications Version'
 BIRTH_DEATH_SEQ_METRIC  = 'bdSeq'
 NODE_ID                 = 'THERMISTOR'
 NUM_MODULES             = 6
 NUM_THERMISTORS         = 32
+NUM_ADC_GROUPS          = 4
 DEFAULT_BROKER_URL      = 'localhost'
 DEFAULT_BROKER_PORT     = 1883
 DEFAULT_MODULE_ID       = 0
 SHOW_OPTIONS            = [ 'none', 'errors', 'topic', 'changed', 'all' ]
-CAL_OPTIONS             = [ 'temp1', 'temp2', 'status', 'clear' ]
+CAL_OPTIONS             = [ 'temp1', 'temp2', 'point', 'fit', 'samples', 'status', 'clear' ]
+CAL_FITS                = [ 'piecewise', 'linear', 'quadratic', 'cubic' ]
+ADC_OPTIONS             = { 'osr': 'OSR', 'prescaler': 'Prescaler', 'autozero': 'Auto Zero', 'settle': 'Settle Time' }
+STATS_METRICS           = [ 'Std Dev', 'Min', 'Max', 'Count' ]
+FILTER_OPTIONS          = { 'mode': 'Mode', 'length': 'Length', 'alpha': 'EMA Alpha' }
+FILTER_MODES            = [ 'none', 'boxcar', 'median', 'ema', 'fir' ]
 
 module_is_alive      = False
 compatible_version   = False
@@ -88,7 +94,25 @@ Metrics = (
     [ MetricSpec( None, 'Node Control/Calibration Temperature 2',   'strip to /', False ) ] +
     [ MetricSpec( None, 'Properties/Calibration Status',            'strip to /', False ) ] +
     [ MetricSpec( None, 'Node Control/Calibration INW',             'strip to /', False ) ] +
-    [ MetricSpec( None, 'Node Control/Clear Cal Data',              'strip to /', False ) ]
+    [ MetricSpec( None, 'Node Control/Clear Cal Data',              'strip to /', False ) ] +
+    [ MetricSpec( None, f'Node Control/ADC Group {group + 1} {setting}', 'strip to /', False ) for group in range( NUM_ADC_GROUPS ) for setting in ADC_OPTIONS.values() ] +
+    [ MetricSpec( None, 'Node Control/Publish Statistics',          'strip to /', False ) ] +
+    [ MetricSpec( None, f'Node Control/Filter Group {group + 1} {setting}', 'strip to /', False ) for group in range( NUM_ADC_GROUPS ) for setting in FILTER_OPTIONS.values() ] +
+    [ MetricSpec( None, 'Node Control/Temperature Deadband',        'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Heartbeat Interval',          'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Channel Enable Mask',         'strip to /', False ) ] +
+    [ MetricSpec( None, 'Properties/Channel Fault Mask',            'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Calibration Point',           'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Calibration Fit',             'strip to /', False ) ] +
+    [ MetricSpec( None, 'Properties/Calibration Points',            'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Calibration Samples',         'strip to /', False ) ] +
+    [ MetricSpec( None, 'Properties/Calibration Progress',          'strip to /', False ) ] +
+    [ MetricSpec( None, 'Properties/Calibration Noise',             'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/ADC Calibrate',               'strip to /', False ) ] +
+    [ MetricSpec( None, 'Properties/ADC Offset Correction',         'strip to /', False ) ] +
+    [ MetricSpec( None, 'Properties/ADC Gain Correction',           'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Break Before Make',           'strip to /', False ) ] +
+    [ MetricSpec( None, f'Statistics/THERMISTOR{thermistor + 1} {stat}', 'strip to /', True ) for thermistor in range( NUM_THERMISTORS ) for stat in STATS_METRICS ]
     )
 
 # Reset the aliases and/or values for all the metrics of the specified device
@@ -129,7 +153,8 @@ def update_metrics( device, payload, set_alias = False ):
             if metric.datatype == MetricDataType.Boolean:
                 metric_spec.value = metric.boolean_value
             elif metric.datatype == MetricDataType.Int64:
-                metric_spec.value = metric.long_value
+                # Sparkplug carries Int64 values as unsigned 64-bit integers
+                metric_spec.value = metric.long_value - ( 1 << 64 ) if metric.long_value >= ( 1 << 63 ) else metric.long_value
             elif metric.datatype == MetricDataType.UInt64:
                 metric_spec.value = metric.long_value
             elif metric.datatype == MetricDataType.Float:
@@ -461,7 +486,11 @@ def display_metrics( topic, payload, save_to_log ):
         if metric.value == None:
             metric.value_str = f'{metric.value}'
         elif metric.name.startswith( 'Inputs/THERMISTOR' ):
-            metric.value_str = f'{metric.value:.3f} °C'
+            if units == 'm°C':
+                # Integer milli-degrees, with the most negative 32-bit value for no data
+                metric.value_str = 'no data' if metric.value == -( 1 << 31 ) else f'{metric.value / 1000:.3f} °C'
+            else:
+                metric.value_str = f'{metric.value:.3f} °C'
         elif metric.name == 'Inputs/ADC Internal Temperature':
             metric.value_str = f'{metric.value:.2f} °C'
         elif metric.name == 'Node Control/Calibration Temperature 1':
@@ -637,6 +666,55 @@ def send_cal_command(temp1, temp2, clear):
 
     
              
+# Send an NCMD message changing one of the ADC conversion settings of a channel group
+def send_adc_setting_command( group, setting, value ):
+    metric_name = f'Node Control/ADC Group {group} {ADC_OPTIONS[ setting ]}'
+    try:
+        payload = get_cmd_payload()
+        if setting == 'autozero':
+            add_metric_as_alias( payload, None, metric_name, MetricDataType.Boolean, value.lower() in [ 'on', 'true', '1' ] )
+        else:
+            add_metric_as_alias( payload, None, metric_name, MetricDataType.Int64, int( value ) )
+        byte_array = bytearray( payload.SerializeToString() )
+        client.publish( NODE_CMD_TOPIC, byte_array, 0, False )
+        report( f'{metric_name} set to {value}', always = True )
+        return True
+    except ValueError:
+        report( f'Invalid metric or value: "{metric_name}" = "{value}"', error = True, always = True )
+        return False
+
+# Send an NCMD message changing one of the filter settings of a channel group
+def send_filter_setting_command( group, setting, value ):
+    metric_name = f'Node Control/Filter Group {group} {FILTER_OPTIONS[ setting ]}'
+    try:
+        payload = get_cmd_payload()
+        if setting == 'mode':
+            add_metric_as_alias( payload, None, metric_name, MetricDataType.Int64, FILTER_MODES.index( value.lower() ) )
+        elif setting == 'alpha':
+            add_metric_as_alias( payload, None, metric_name, MetricDataType.Float, float( value ) )
+        else:
+            add_metric_as_alias( payload, None, metric_name, MetricDataType.Int64, int( value ) )
+        byte_array = bytearray( payload.SerializeToString() )
+        client.publish( NODE_CMD_TOPIC, byte_array, 0, False )
+        report( f'{metric_name} set to {value}', always = True )
+        return True
+    except ValueError:
+        report( f'Invalid metric or value: "{metric_name}" = "{value}"', error = True, always = True )
+        return False
+
+# Send an NCMD message changing the temperature deadband (°C), heartbeat interval (ms) or channel enable mask
+def send_report_setting_command( metric_name, datatype, value ):
+    try:
+        payload = get_cmd_payload()
+        add_metric_as_alias( payload, None, metric_name, datatype, value )
+        byte_array = bytearray( payload.SerializeToString() )
+        client.publish( NODE_CMD_TOPIC, byte_array, 0, False )
+        report( f'{metric_name} set to {value}', always = True )
+        return True
+    except ValueError:
+        report( f'Invalid metric or value: "{metric_name}" = "{value}"', error = True, always = True )
+        return False
+
 # Main program starts here
 
 # Set the default option values
@@ -757,12 +835,30 @@ if option_no_GUI:
             close_thread = True
             sys.exit()
         elif command[ 0 ] == 'calibrate':
-            if len( command ) != 2:
-                report( 'Invalid use, must be of the form "calibrate CAL"', error = True, always = True )
+            if len( command ) < 2 or command[ 1 ] not in CAL_OPTIONS:
+                report( f'Invalid use, must be of the form "calibrate CAL" where CAL is one of {CAL_OPTIONS}', error = True, always = True )
+                continue
+            elif command[ 1 ] in [ 'point', 'fit', 'samples' ] and len( command ) != 3:
+                report( f'Invalid use, must be of the form "calibrate {command[ 1 ]} VALUE"', error = True, always = True )
                 continue
-            if command[ 1 ] not in CAL_OPTIONS:
-                report( f'Invalid use, CAL must be one of {CAL_OPTIONS}', error = True, always = True )
+            elif command[ 1 ] not in [ 'point', 'fit', 'samples' ] and len( command ) != 2:
+                report( 'Invalid use, must be of the form "calibrate CAL"', error = True, always = True )
                 continue
+            elif command [ 1 ] == 'point':
+                try:
+                    send_report_setting_command( 'Node Control/Calibration Point', MetricDataType.Float, float( command[ 2 ] ) )
+                except ValueError:
+                    report( 'Invalid use, must be of the form "calibrate point DEGREES"', error = True, always = True )
+            elif command [ 1 ] == 'samples':
+                try:
+                    send_report_setting_command( 'Node Control/Calibration Samples', MetricDataType.Int64, int( command[ 2 ] ) )
+                except ValueError:
+                    report( 'Invalid use, must be of the form "calibrate samples COUNT"', error = True, always = True )
+            elif command [ 1 ] == 'fit':
+                if command[ 2 ].lower() not in CAL_FITS:
+                    report( f'Invalid use, fit must be one of {CAL_FITS}', error = True, always = True )
+                    continue
+                send_report_setting_command( 'Node Control/Calibration Fit', MetricDataType.Int64, CAL_FITS.index( command[ 2 ].lower() ) )
             elif command [ 1 ] == 'temp1':
                 #cal_started = True
                 send_cal_command(True, False, False)
@@ -775,13 +871,68 @@ if option_no_GUI:
                 metric.value_str = f'{metric.value}'
                 metric.timestamp_str = f'{metric.timestamp}'
                 print( f'{metric.display_name} at {metric.timestamp_str} = {metric.value_str}' )
-                metric = find_metric(None, 'Node Control/Calibration INW')
-                metric.value_str = f'{metric.value}'
-                metric.timestamp_str = f'{metric.timestamp}'
-                print( f'{metric.display_name} at {metric.timestamp_str} = {metric.value_str}' )
+                for name in [ 'Node Control/Calibration INW', 'Properties/Calibration Progress', 'Properties/Calibration Noise' ]:
+                    metric = find_metric(None, name)
+                    metric.value_str = f'{metric.value}'
+                    metric.timestamp_str = f'{metric.timestamp}'
+                    print( f'{metric.display_name} at {metric.timestamp_str} = {metric.value_str}' )
                             
 
 
+        elif command[ 0 ] == 'adccal':
+            if send_simple_node_command( 'Node Control/ADC Calibrate', True ):
+                report( 'ADC offset and gain calibration requested', always = True )
+        elif command[ 0 ] == 'stats':
+            if len( command ) != 2 or command[ 1 ] not in [ 'on', 'off' ]:
+                report( 'Invalid use, must be of the form "stats on" or "stats off"', error = True, always = True )
+                continue
+            if send_simple_node_command( 'Node Control/Publish Statistics', command[ 1 ] == 'on' ):
+                report( f'Statistics publishing turned {command[ 1 ]}', always = True )
+        elif command[ 0 ] == 'adc':
+            if len( command ) != 4:
+                report( 'Invalid use, must be of the form "adc GROUP SETTING VALUE"', error = True, always = True )
+                continue
+            if command[ 1 ] not in [ f'{group + 1}' for group in range( NUM_ADC_GROUPS ) ]:
+                report( f'Invalid use, GROUP must be 1-{NUM_ADC_GROUPS}', error = True, always = True )
+                continue
+            if command[ 2 ] not in ADC_OPTIONS:
+                report( f'Invalid use, SETTING must be one of {list( ADC_OPTIONS )}', error = True, always = True )
+                continue
+            send_adc_setting_command( command[ 1 ], command[ 2 ], command[ 3 ] )
+        elif command[ 0 ] == 'deadband':
+            try:
+                send_report_setting_command( 'Node Control/Temperature Deadband', MetricDataType.Float, float( command[ 1 ] ) )
+            except ( IndexError, ValueError ):
+                report( 'Invalid use, must be of the form "deadband DEGREES"', error = True, always = True )
+        elif command[ 0 ] == 'heartbeat':
+            try:
+                send_report_setting_command( 'Node Control/Heartbeat Interval', MetricDataType.Int64, int( command[ 1 ] ) )
+            except ( IndexError, ValueError ):
+                report( 'Invalid use, must be of the form "heartbeat MILLISECONDS"', error = True, always = True )
+        elif command[ 0 ] == 'breakbeforemake':
+            try:
+                send_report_setting_command( 'Node Control/Break Before Make', MetricDataType.Int64, int( command[ 1 ] ) )
+            except ( IndexError, ValueError ):
+                report( 'Invalid use, must be of the form "breakbeforemake MICROSECONDS"', error = True, always = True )
+        elif command[ 0 ] == 'channels':
+            try:
+                mask = int( command[ 1 ], 0 )
+                if mask <= 0 or mask >= 1 << NUM_THERMISTORS:
+                    raise ValueError
+                send_report_setting_command( 'Node Control/Channel Enable Mask', MetricDataType.Int64, mask )
+            except ( IndexError, ValueError ):
+                report( 'Invalid use, must be of the form "channels MASK", e.g. "channels 0xFFFF" for thermistors 1-16', error = True, always = True )
+        elif command[ 0 ] == 'filter':
+            if len( command ) != 4:
+                report( 'Invalid use, must be of the form "filter GROUP SETTING VALUE"', error = True, always = True )
+                continue
+            if command[ 1 ] not in [ f'{group + 1}' for group in range( NUM_ADC_GROUPS ) ]:
+                report( f'Invalid use, GROUP must be 1-{NUM_ADC_GROUPS}', error = True, always = True )
+                continue
+            if command[ 2 ] not in FILTER_OPTIONS:
+                report( f'Invalid use, SETTING must be one of {list( FILTER_OPTIONS )}', error = True, always = True )
+                continue
+            send_filter_setting_command( command[ 1 ], command[ 2 ], command[ 3 ] )
         elif command[ 0 ] == 'help' or command[ 0 ] == 'h' or command[ 0 ] == '?':
             print( f'Thermistor Mux Client v{APP_VERSION} connected to Module {option_module_id}' )
             print( f'Commands:' )
@@ -796,8 +947,27 @@ if option_no_GUI:
             print( f'    calibrate CAL_OPTIONS = check calibration status, calibrate thermistors or clear calibration data, where CAL_OPTIONS is one of:')
             print( f'        temp1 = runs calibration routine for first temperature extreme. (Will set Calibration INW to true)')
             print( f'        temp2 = runs calibration routine for second temperature extreme.')
-            print( f'        status = Displays thermistor mux calibration status.')
+            print( f'        point DEGREES = captures one point of a multi-point calibration at the exact reference temperature given, up to 8 points.')
+            print( f'        fit METHOD = fits the captured points and saves the calibration, where METHOD is one of {CAL_FITS}.')
+            print( f'            piecewise needs 2 points, linear 2, quadratic 3 and cubic 4.')
+            print( f'        samples COUNT = sets the number of samples of each thermistor averaged into each calibration point, 1 to 1000 (default 20).')
+            print( f'        status = Displays thermistor mux calibration status, and the progress and noise of the point being captured.')
             print( f'        clear = Permanently deletes stored calibration data. (Temperature displayed will be then be raw values)')
+            print( f'    adc GROUP SETTING VALUE = change an ADC conversion setting for a group of 8 thermistors (1-{NUM_ADC_GROUPS}), where SETTING is one of:' )
+            print( f'        osr = oversampling ratio, 32 to 98304 (20480 gives 60 samples/sec)' )
+            print( f'        prescaler = clock prescaler, 1, 2, 4 or 8' )
+            print( f'        autozero = input auto-zeroing, on or off (on halves the data rate)' )
+            print( f'        settle = microseconds allowed for each thermistor to settle after its MOSFET is turned on, 0 to 100000' )
+            print( f'    filter GROUP SETTING VALUE = change the filter applied to each pass for a group of 8 thermistors (1-{NUM_ADC_GROUPS}), where SETTING is one of:' )
+            print( f'        mode = one of {FILTER_MODES}; none publishes the mean of each frame' )
+            print( f'        length = number of passes spanned by the boxcar, median and fir filters, 1 to 16' )
+            print( f'        alpha = weight of each new pass in the ema filter, 0 to 1' )
+            print( f'    breakbeforemake MICROSECONDS = time between turning one MOSFET off and the next one on, 0 to 100000' )
+            print( f'    channels MASK = scan only the thermistors whose bits are set, bit 0 for THERMISTOR1; open or shorted thermistors are also skipped automatically' )
+            print( f'    deadband DEGREES = only publish a temperature when it changes by this much, 0 publishes every frame' )
+            print( f'    heartbeat MILLISECONDS = publish a temperature at least this often while it is within the deadband, 0 never' )
+            print( f'    adccal = measure the ADC offset and gain again after the current frame (they are also measured at startup and every 10 minutes)' )
+            print( f'    stats on|off = publish the standard deviation, min, max and sample count of each thermistor in every frame' )
             print( f'    log = toggle logging data messages to CSV on or off' )
             print( f'    quit, exit, <Ctrl-D> = stop this program' )
             print( f'    help, h, ? = display this list of commands' )
@@ -10,6 +10,7 @@
 
 
 #include "cf_sparkplug.h"
+#include <pb_encode.h>
 
 
 /*
@@ -20,15 +21,73 @@
 char cf_sparkplug_error[MAX_CF_SPARKPLUG_ERROR_LEN] = "No error";
 
 // Sparkplug variables
-static uint8_t encode_buffer[BIN_BUF_SIZE];  // Buffer to store encoded binary data for Sparkplug
+static uint8_t will_buffer[WILL_BUF_SIZE];   // Buffer to store the encoded will payload
+
+// A payload being published is encoded straight into the broker connection,
+// collected into chunks so the network isn't sent a write per field
+static uint8_t stream_chunk[STREAM_CHUNK_SIZE];
+static size_t  stream_chunk_used = 0;
+
+// Payload template: the last payload encoded, with the position of each value
+// that changes from one payload to the next, so a payload with the same
+// metrics can be encoded by patching in its values.  A varint keeps its
+// position only while its encoded size is unchanged.
+typedef struct
+{
+    uint16_t  offset;   // Position in the encoded payload
+    uint8_t   size;     // Encoded size in bytes
+} TemplateField;
+
+typedef struct
+{
+    uint64_t      alias;
+    uint32_t      datatype;
+    pb_size_t     which_value;
+    TemplateField timestamp;
+    TemplateField value;
+} TemplateMetric;
+
+static uint8_t        template_buffer[PAYLOAD_TEMPLATE_SIZE];
+static size_t         template_len = 0;    // Zero if there's no template
+static pb_size_t      template_count = 0;  // Number of metrics
+static TemplateField  template_timestamp;
+static TemplateField  template_seq;
+static TemplateMetric template_metrics[TEMPLATE_MAX_METRICS];
 
 static uint8_t m_seq = 0;   // The message sequence number (wraps at 255 back to 0)
 
 // Module-level metrics and payload for publishing messages
-static unsigned int  m_max_metrics = 0;
-static Metric       *m_metrics = NULL;
+static Metric        m_metrics[MAX_PAYLOAD_METRICS];
 static Payload       m_payload = org_eclipse_tahu_protobuf_Payload_init_default;
 
+// Lookup tables for a metrics array, built by check_metrics(), so a metric can
+// be found by its alias, variable or name without searching the array
+typedef struct
+{
+    MetricSpec    *metrics;
+    int            num_metrics;
+    unsigned int   first_alias;
+    MetricSpec   **by_alias;       // Indexed by alias - first_alias
+    MetricSpec   **by_variable;    // Hash table of variable pointers, open addressing
+    MetricSpec   **by_name;        // Hash table of names, open addressing
+    uint32_t      *name_hash;      // Hash of the name in each by_name slot
+    unsigned int   table_mask;     // Hash table size - 1; the size is a power of 2
+} MetricIndex;
+
+static MetricIndex   m_indexes[MAX_METRIC_ARRAYS];
+static int           m_num_indexes = 0;
+static MetricIndex  *m_last_index = NULL;  // The index found most recently
+
+// Storage for the lookup tables, handed out to the arrays as they are checked.
+// Each hash table has fewer than 4 slots per metric.
+#define TABLE_POOL_SIZE  (4 * MAX_INDEXED_METRICS)
+static MetricSpec   *m_alias_pool[MAX_INDEXED_METRICS];
+static MetricSpec   *m_variable_pool[TABLE_POOL_SIZE];
+static MetricSpec   *m_name_pool[TABLE_POOL_SIZE];
+static uint32_t      m_name_hash_pool[TABLE_POOL_SIZE];
+static unsigned int  m_alias_pool_used = 0;
+static unsigned int  m_table_pool_used = 0;
+
 
 // Default timestamp function that just returns zero.  Replace this by calling
 // set_gettimestamp_callback() with a valid function.
@@ -47,22 +106,130 @@ void set_gettimestamp_callback(GetTimestamp timestamp_function){
 }
 
 
-// Set the maximum number of metrics that will ever need to be sent in a single
-// payload.
-void set_max_metrics(unsigned int max_metrics){
-    // Adjust the size of the allocated memory to handle the specified number
-    // of metrics
-    m_max_metrics = max_metrics;
-    if(m_max_metrics > 0)
-        m_metrics = (Metric *) realloc(m_metrics, m_max_metrics * sizeof(*m_metrics));
-    else{
-        free(m_metrics);
-        m_metrics = NULL;
+// Return the lookup tables for the specified metrics array, or NULL if
+// check_metrics() hasn't indexed it.  There are only a few arrays, and the
+// same one is usually looked up several times in a row.
+static MetricIndex * find_index(const MetricSpec *metrics, int num_metrics){
+    if(m_last_index != NULL && m_last_index->metrics == metrics &&
+       m_last_index->num_metrics == num_metrics)
+        return m_last_index;
+
+    for(int i = 0; i < m_num_indexes; i++){
+        if(m_indexes[i].metrics == metrics && m_indexes[i].num_metrics == num_metrics){
+            m_last_index = &m_indexes[i];
+            return m_last_index;
+        }
+    }
+    return NULL;
+}
+
+
+// Return the first slot to try in a variable hash table.  Variables are
+// word-aligned, so the low bits are dropped before the multiplicative hash.
+static unsigned int variable_slot(const void *variable, unsigned int mask){
+    return ((uint32_t) ((uintptr_t) variable >> 2) * 2654435761UL) >> 8 & mask;
+}
+
+
+// Return the FNV-1a hash of a metric name.
+static uint32_t name_hash(const char *name){
+    uint32_t hash = 2166136261UL;
+    while(*name != '\0'){
+        hash ^= (uint8_t) *name++;
+        hash *= 16777619UL;
     }
+    return hash;
+}
+
+
+// Fill in the name hash table of an index from its metrics array.  Names are
+// compared only when their hashes match, so a lookup usually costs one hash
+// of the received name and one strcmp().  If two metrics share a name, the
+// first one is found, as in a search of the array.
+static void build_name_index(MetricIndex *index){
+    for(int idx = 0; idx < index->num_metrics; idx++){
+        MetricSpec *metric = &index->metrics[idx];
+        uint32_t hash = name_hash(metric->name);
+        unsigned int slot = hash & index->table_mask;
+        while(index->by_name[slot] != NULL &&
+              (index->name_hash[slot] != hash || strcmp(index->by_name[slot]->name, metric->name) != 0))
+            slot = (slot + 1) & index->table_mask;
+        if(index->by_name[slot] == NULL){
+            index->by_name[slot] = metric;
+            index->name_hash[slot] = hash;
+        }
+    }
+}
 
-    // Discard any metrics from the current payload beyond the new maximum
-    if(m_payload.metrics_count > m_max_metrics)
-        m_payload.metrics_count = m_max_metrics;
+
+// Return the metric with the specified name from an index, or NULL if there
+// isn't one.
+static MetricSpec * find_indexed_name(const MetricIndex *index, const char *name){
+    uint32_t hash = name_hash(name);
+    unsigned int slot = hash & index->table_mask;
+    while(index->by_name[slot] != NULL){
+        if(index->name_hash[slot] == hash && strcmp(index->by_name[slot]->name, name) == 0)
+            return index->by_name[slot];
+        slot = (slot + 1) & index->table_mask;
+    }
+    return NULL;
+}
+
+
+// Fill in the variable hash table of an index from its metrics array.  If two
+// metrics share a variable, the first one is found, as in a search of the
+// array.
+static void build_variable_index(MetricIndex *index){
+    memset(index->by_variable, 0, (index->table_mask + 1) * sizeof(*index->by_variable));
+    for(int idx = 0; idx < index->num_metrics; idx++){
+        MetricSpec *metric = &index->metrics[idx];
+        unsigned int slot = variable_slot(metric->variable, index->table_mask);
+        while(index->by_variable[slot] != NULL &&
+              index->by_variable[slot]->variable != metric->variable)
+            slot = (slot + 1) & index->table_mask;
+        if(index->by_variable[slot] == NULL)
+            index->by_variable[slot] = metric;
+    }
+}
+
+
+// Return the lookup tables for a metrics array, with the tables empty.  An
+// array that is checked again keeps its tables; otherwise they are taken from
+// the pools.  Returns NULL if there's no room left for them.
+static MetricIndex * allocate_index(MetricSpec *metrics, int num_metrics){
+    // The hash tables are at most half full
+    unsigned int table_size = 1;
+    while(table_size < 2 * (unsigned) num_metrics)
+        table_size <<= 1;
+
+    MetricIndex *index = find_index(metrics, num_metrics);
+    if(index == NULL){
+        if(m_num_indexes >= MAX_METRIC_ARRAYS){
+            snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
+                     "Too many metrics arrays, > %d", MAX_METRIC_ARRAYS);
+            return NULL;
+        }
+        if(m_alias_pool_used + num_metrics > MAX_INDEXED_METRICS ||
+           m_table_pool_used + table_size > TABLE_POOL_SIZE){
+            snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
+                     "Too many metrics to index, > %d", MAX_INDEXED_METRICS);
+            return NULL;
+        }
+        index = &m_indexes[m_num_indexes++];
+        index->metrics = metrics;
+        index->num_metrics = num_metrics;
+        index->by_alias = &m_alias_pool[m_alias_pool_used];
+        index->by_variable = &m_variable_pool[m_table_pool_used];
+        index->by_name = &m_name_pool[m_table_pool_used];
+        index->name_hash = &m_name_hash_pool[m_table_pool_used];
+        index->table_mask = table_size - 1;
+        m_alias_pool_used += num_metrics;
+        m_table_pool_used += table_size;
+    }
+
+    memset(index->by_alias, 0, num_metrics * sizeof(*index->by_alias));
+    memset(index->by_name, 0, table_size * sizeof(*index->by_name));
+    return index;
 }
 
 
@@ -86,15 +253,21 @@ bool set_metric_variable(MetricSpec *metrics, int num_metrics,
     // Found the metric - set its variable pointer to the specified address
     metric->variable = variable;
 
+    // Keep the array's variable lookup up to date if it has been indexed
+    MetricIndex *index = find_index(metrics, num_metrics);
+    if(index != NULL)
+        build_variable_index(index);
+
     // Success
     return true;
 }
 
 
 // Make sure all the metrics in the given array have unique alias numbers in
-// the given range, have non-empty names, and have been linked to variables.
-// Also, if necessary increase the maximum number of metrics that can be sent
-// in a single payload to the number of metrics in this array.
+// the given range, have non-empty names, and have been linked to variables,
+// and build the tables used to find the array's metrics by alias, variable and
+// name.  The tables come from static storage.  The payload storage is fixed at
+// MAX_PAYLOAD_METRICS, so an array with more metrics than that is rejected.
 bool check_metrics(MetricSpec *metrics, int num_metrics, unsigned int end_alias){
     // Check the parameters are valid
     if(metrics == NULL || num_metrics <= 0){
@@ -103,33 +276,36 @@ bool check_metrics(MetricSpec *metrics, int num_metrics, unsigned int end_alias)
                  "Empty metrics array");
         return false;
     }
-
-    // Set up a temporary array to track which aliases have been used
-    unsigned int first_alias = end_alias - num_metrics;
-    unsigned int last_alias  = end_alias - 1;
-    bool *alias_found = (bool *) calloc(num_metrics, sizeof(*alias_found));
-    if(alias_found == NULL){
+    if(num_metrics > MAX_PAYLOAD_METRICS){
+        // The full array couldn't be sent in a payload
         snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                 "No memory for %d alias_found entries", num_metrics);
+                 "Too many metrics, %d > %d", num_metrics, MAX_PAYLOAD_METRICS);
         return false;
     }
 
+    // The alias table tracks which aliases have been used
+    int num_indexes = m_num_indexes;
+    MetricIndex *index = allocate_index(metrics, num_metrics);
+    if(index == NULL)
+        return false;
+    unsigned int first_alias = end_alias - num_metrics;
+    unsigned int last_alias  = end_alias - 1;
+
     // Check each metric in the array
+    bool valid = false;
     for(int idx = 0; idx < num_metrics; idx++){
         MetricSpec *metric = &metrics[idx];
         if(metric->name == NULL || strcmp(metric->name, "") == 0){
             // This metric hasn't been given a valid name
             snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
                      "Empty name for metric #%d", idx);
-            free(alias_found);
-            return false;
+            break;
         }
         if(metric->variable == NULL){
             // This metric hasn't been linked to a variable
             snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
                      "Null variable for metric #%d (%s)", idx, metric->name);
-            free(alias_found);
-            return false;
+            break;
         }
         unsigned int alias_num = metric->alias;
         if(alias_num < first_alias || alias_num > last_alias){
@@ -137,26 +313,36 @@ bool check_metrics(MetricSpec *metrics, int num_metrics, unsigned int end_alias)
             snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
                      "Metric alias is out of range: %d [%d,%d]",
                      alias_num, first_alias, last_alias);
-            free(alias_found);
-            return false;
+            break;
         }
-        if(alias_found[alias_num - first_alias]){
+        if(index->by_alias[alias_num - first_alias] != NULL){
             // Alias number has already been used
             snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
                      "Metric alias has already been used: %d", alias_num);
-            free(alias_found);
-            return false;
+            break;
         }
-        alias_found[alias_num - first_alias] = true;
+        index->by_alias[alias_num - first_alias] = metric;
+        valid = (idx == num_metrics - 1);
     }
 
-    free(alias_found);
-
-    // Set aside enough memory to store at least this many metrics
-    if((unsigned) num_metrics > m_max_metrics)
-        set_max_metrics(num_metrics);
+    if(!valid){
+        // Leave the array unindexed, giving back its tables if they were only
+        // just taken from the pools so that a corrected array can use them
+        index->metrics = NULL;
+        m_last_index = NULL;
+        if(m_num_indexes > num_indexes){
+            m_num_indexes--;
+            m_alias_pool_used -= num_metrics;
+            m_table_pool_used -= index->table_mask + 1;
+        }
+        return false;
+    }
 
-    // All alias numbers are valid and unique
+    // All alias numbers are valid and unique, so the array can be looked up by
+    // them
+    index->first_alias = first_alias;
+    build_variable_index(index);
+    build_name_index(index);
     return true;
 }
 
@@ -173,10 +359,18 @@ MetricSpec * find_metric_by_alias(MetricSpec *metrics, int num_metrics,
         return NULL;
     }
 
-    for(int idx = 0; idx < num_metrics; idx++){
-        if(metrics[idx].alias == alias)
-            // Found it
-            return &metrics[idx];
+    MetricIndex *index = find_index(metrics, num_metrics);
+    if(index != NULL){
+        // The aliases are consecutive, so the alias is the index
+        if(alias - index->first_alias < (unsigned) num_metrics)
+            return index->by_alias[alias - index->first_alias];
+    }
+    else{
+        for(int idx = 0; idx < num_metrics; idx++){
+            if(metrics[idx].alias == alias)
+                // Found it
+                return &metrics[idx];
+        }
     }
 
     // A metric with the specified alias wasn't in the metrics array
@@ -203,10 +397,22 @@ MetricSpec * find_metric_by_variable(MetricSpec *metrics, int num_metrics,
         return NULL;
     }
 
-    for(int idx = 0; idx < num_metrics; idx++){
-        if(metrics[idx].variable == variable)
-            // Found it
-            return &metrics[idx];
+    MetricIndex *index = find_index(metrics, num_metrics);
+    if(index != NULL){
+        unsigned int slot = variable_slot(variable, index->table_mask);
+        while(index->by_variable[slot] != NULL){
+            if(index->by_variable[slot]->variable == variable)
+                // Found it
+                return index->by_variable[slot];
+            slot = (slot + 1) & index->table_mask;
+        }
+    }
+    else{
+        for(int idx = 0; idx < num_metrics; idx++){
+            if(metrics[idx].variable == variable)
+                // Found it
+                return &metrics[idx];
+        }
     }
 
     // A metric with the specified variable wasn't in the metrics array
@@ -242,20 +448,37 @@ MetricSpec * find_received_metric(MetricSpec *metrics, int num_metrics, Metric *
     }
 
     bool found = false;
-    int idx;
-    for(idx = 0; idx < num_metrics; idx++){
-        if(metric->name != NULL){
-            // The name was supplied - check to see if it matches
-            if(strcmp(metrics[idx].name, metric->name) == 0){
+    int idx = 0;
+    MetricIndex *index = find_index(metrics, num_metrics);
+    if(index != NULL){
+        MetricSpec *match = NULL;
+        if(metric->name != NULL)
+            // The name was supplied - look it up
+            match = find_indexed_name(index, metric->name);
+        else if(metric->alias >= index->first_alias &&
+                metric->alias - index->first_alias < (unsigned) num_metrics)
+            // Only the alias was supplied - it indexes the metrics directly
+            match = index->by_alias[metric->alias - index->first_alias];
+        if(match != NULL){
+            idx = match - metrics;
+            found = true;
+        }
+    }
+    else{
+        for(idx = 0; idx < num_metrics; idx++){
+            if(metric->name != NULL){
+                // The name was supplied - check to see if it matches
+                if(strcmp(metrics[idx].name, metric->name) == 0){
+                    found = true;
+                    break;
+                }
+            }
+            // Only check the alias if the name wasn't supplied
+            else if(metrics[idx].alias == metric->alias){
                 found = true;
                 break;
             }
         }
-        // Only check the alias if the name wasn't supplied
-        else if(metrics[idx].alias == metric->alias){
-            found = true;
-            break;
-        }
     }
 
     if(!found){
@@ -293,6 +516,32 @@ MetricSpec * find_received_metric(MetricSpec *metrics, int num_metrics, Metric *
 }
 
 
+// Set the deadband and maximum publishing interval of the metric with the
+// specified variable.  Returns false if the metric can't be found or isn't a
+// FLOAT or INT64 metric; otherwise returns true.
+bool set_metric_deadband(MetricSpec *metrics, int num_metrics, void *variable,
+                         float deadband, bool percent, unsigned long max_interval){
+    MetricSpec *metric = find_metric_by_variable(metrics, num_metrics, variable);
+    if(metric == NULL)
+        // Couldn't find the specified metric
+        return false;
+
+    if(metric->datatype != METRIC_DATA_TYPE_FLOAT && metric->datatype != METRIC_DATA_TYPE_INT64){
+        // Only numeric metrics have a deadband
+        snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
+                 "Metric has no deadband: %s", metric->name);
+        return false;
+    }
+
+    metric->deadband = deadband;
+    metric->deadband_percent = percent;
+    metric->max_interval = max_interval;
+
+    // Success
+    return true;
+}
+
+
 // Mark the metric with the specified variable as updated.  This also sets its
 // timestamp.  Returns false if the metric can't be found; otherwise returns
 // true.
@@ -324,18 +573,19 @@ bool connect(PubSubClient *broker, const char *nodeId, const char *willTopic){
     // Include the current metrics list in the payload
     m_payload.metrics = m_metrics;
 
-    // Encode the module payload to a buffer
+    // Encode the module payload to a buffer; PubSubClient keeps a pointer to
+    // it, so it can't be streamed
     sparkplugb_arduino_encoder encoder;
-    int msg_len = encoder.encode(&m_payload, encode_buffer, BIN_BUF_SIZE);
+    int msg_len = encoder.encode(&m_payload, will_buffer, WILL_BUF_SIZE);
     //### What is an invalid value for msg_len?
-    if(msg_len <= 0 || msg_len > BIN_BUF_SIZE){
+    if(msg_len <= 0 || msg_len > WILL_BUF_SIZE){
         snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
                  "Failed to encode Will payload: %d", msg_len);
         return false;
     }
 
     // Try to connect to the broker, registering the will message
-    if(!broker->connect(nodeId, willTopic, 0, false, encode_buffer, msg_len)){
+    if(!broker->connect(nodeId, willTopic, 0, false, will_buffer, msg_len)){
         // Can't connect
         snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
                  "Broker refused connection");
@@ -398,9 +648,44 @@ void set_up_ndeath_payload(void){
 }
 
 
+// Return the value of a FLOAT or INT64 metric, or zero for other types.
+static double metric_value(const MetricSpec *metric){
+    switch(metric->datatype){
+    case METRIC_DATA_TYPE_INT64:
+        return *(int64_t *) metric->variable;
+    case METRIC_DATA_TYPE_FLOAT:
+        return *(float *) metric->variable;
+    default:
+        return 0;
+    }
+}
+
+
+// Return true if the metric's update should be held back because it is within
+// the deadband of the last published value and the maximum interval hasn't
+// passed.
+static bool within_deadband(const MetricSpec *metric){
+    if(metric->deadband <= 0 || !metric->published)
+        return false;
+    if(metric->max_interval > 0 && millis() - metric->published_millis >= metric->max_interval)
+        return false;
+
+    // A value that is still not a number hasn't changed
+    double value = metric_value(metric);
+    if(isnan(value) && isnan(metric->published_value))
+        return true;
+
+    double deadband = metric->deadband;
+    if(metric->deadband_percent)
+        deadband *= fabs(metric->published_value) / 100;
+    return fabs(value - metric->published_value) < deadband;
+}
+
+
 // Add the specified metric to the module payload.  If full is false, the
-// metric is only added if it has been updated; if full is true the metric is
-// added regardless and its name is included.  If the metric's timestamp is
+// metric is only added if it has been updated and the update isn't held back
+// by its deadband; if full is true the metric is added regardless and its name
+// is included.  A held back update stays pending.  If the metric's timestamp is
 // zero it is set now.  Returns false if an error occurs; otherwise returns
 // true.
 bool add_metric_to_payload(bool full, MetricSpec *metric){
@@ -418,22 +703,20 @@ bool add_metric_to_payload(bool full, MetricSpec *metric){
     }
 
     // Add this metric if we're adding the full metric or it has been updated
-    if(full || metric->updated){
-        if(m_metrics == NULL){
-            // No memory set aside for metrics?
-            snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                     "No memory for metrics");
-            return false;
-        }
-        if(m_payload.metrics_count >= m_max_metrics){
+    // outside its deadband
+    if(full || (metric->updated && !within_deadband(metric))){
+        if(m_payload.metrics_count >= MAX_PAYLOAD_METRICS){
             // Payload is already full of metrics
             snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                     "Too many metrics, > %d", m_max_metrics);
+                     "Too many metrics, > %d", MAX_PAYLOAD_METRICS);
             return false;
         }
 
         // The metric change is no longer pending
         metric->updated = false;
+        metric->published = true;
+        metric->published_value = metric_value(metric);
+        metric->published_millis = millis();
 
         // Set the metric timestamp if it hasn't been set
         if(metric->timestamp == 0)
@@ -499,7 +782,8 @@ bool add_metric_to_payload(bool full, MetricSpec *metric){
 // Add the metric with the specified alias or variable to the module payload.
 // If variable is non-NULL then it is used to locate the matching metric.  If
 // variable is NULL then the alias is used to locate the matching metric.  If
-// full is false, the metric is only added if it has been updated; if full is
+// full is false, the metric is only added if it has been updated outside its
+// deadband, or its maximum interval has passed; if full is
 // true the metric is added regardless and its name is included.  Returns false
 // if an error occurs; otherwise returns true.
 bool add_metric(bool full, MetricSpec *metrics, int num_metrics, void *variable,
@@ -515,7 +799,8 @@ bool add_metric(bool full, MetricSpec *metrics, int num_metrics, void *variable,
 }
 
 
-// Add any updated metrics in the array to the module payload.  If full is true
+// Add any updated metrics in the array to the module payload, subject to their
+// deadbands and maximum intervals.  If full is true
 // include all the metrics, whether updated or not, together with their names.
 // Returns false if an error occurs; otherwise returns true.
 bool add_metrics(bool full, MetricSpec *metrics, int num_metrics){
@@ -537,6 +822,256 @@ bool add_metrics(bool full, MetricSpec *metrics, int num_metrics){
 }
 
 
+// Return true if a metric can be encoded from a template: it has no name, and
+// a value of fixed encoded size or a varint.  These are the metrics that
+// add_metric_to_payload() adds to NDATA payloads.
+static bool template_metric(const Metric *metric){
+    return metric->name == NULL && metric->has_alias && metric->has_timestamp &&
+           metric->has_datatype && !metric->has_is_historical &&
+           !metric->has_is_transient && !metric->has_is_null &&
+           !metric->has_metadata && !metric->has_properties &&
+           (metric->which_value == org_eclipse_tahu_protobuf_Payload_Metric_long_value_tag ||
+            metric->which_value == org_eclipse_tahu_protobuf_Payload_Metric_float_value_tag ||
+            metric->which_value == org_eclipse_tahu_protobuf_Payload_Metric_boolean_value_tag);
+}
+
+
+// Read a varint from an encoded payload, advancing the position.  Returns
+// false if it runs past the end.
+static bool read_varint(const uint8_t *buf, size_t len, size_t *pos, uint64_t *value){
+    *value = 0;
+    for(int shift = 0; *pos < len && shift < 64; shift += 7){
+        uint8_t byte = buf[(*pos)++];
+        *value |= (uint64_t) (byte & 0x7F) << shift;
+        if(!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+
+// Read the next field of an encoded message from the template buffer,
+// advancing the position, and find the position and size of its value: a
+// varint, a fixed-size value or the contents of a message.  Returns false if
+// the encoding is invalid.
+static bool next_field(size_t end, size_t *pos, uint32_t *tag, TemplateField *field){
+    uint64_t key, value;
+    if(!read_varint(template_buffer, end, pos, &key))
+        return false;
+    size_t start = *pos;
+    switch(key & 7){
+    case PB_WT_VARINT:
+        if(!read_varint(template_buffer, end, pos, &value))
+            return false;
+        break;
+    case PB_WT_64BIT:
+        *pos += 8;
+        break;
+    case PB_WT_32BIT:
+        *pos += 4;
+        break;
+    case PB_WT_STRING:
+        if(!read_varint(template_buffer, end, pos, &value) || value > end - *pos)
+            return false;
+        start = *pos;
+        *pos += value;
+        break;
+    default:
+        return false;
+    }
+    *tag = key >> 3;
+    field->offset = start;
+    field->size = *pos - start;
+    return *pos <= end;
+}
+
+
+// Find the timestamp and value of an encoded metric in the template buffer.
+// Returns false if the encoding is invalid.
+static bool find_metric_fields(const TemplateField *message, TemplateMetric *entry){
+    size_t pos = message->offset;
+    size_t end = message->offset + message->size;
+    while(pos < end){
+        uint32_t tag;
+        TemplateField field;
+        if(!next_field(end, &pos, &tag, &field))
+            return false;
+        if(tag == org_eclipse_tahu_protobuf_Payload_Metric_timestamp_tag)
+            entry->timestamp = field;
+        else if(tag == entry->which_value)
+            entry->value = field;
+    }
+    return true;
+}
+
+
+// Encode the module payload into the template buffer and find the positions
+// of its values.  Returns false, leaving no template, if the payload can't be
+// encoded from a template.
+static bool build_template(void){
+    template_len = 0;
+    if(!m_payload.has_timestamp || !m_payload.has_seq ||
+       m_payload.metrics_count > TEMPLATE_MAX_METRICS)
+        return false;
+    for(pb_size_t idx = 0; idx < m_payload.metrics_count; idx++)
+        if(!template_metric(&m_metrics[idx]))
+            return false;
+
+    pb_ostream_t stream = pb_ostream_from_buffer(template_buffer, PAYLOAD_TEMPLATE_SIZE);
+    if(!pb_encode(&stream, org_eclipse_tahu_protobuf_Payload_fields, &m_payload))
+        // Doesn't fit the template buffer
+        return false;
+
+    pb_size_t count = 0;
+    size_t pos = 0;
+    while(pos < stream.bytes_written){
+        uint32_t tag;
+        TemplateField field;
+        if(!next_field(stream.bytes_written, &pos, &tag, &field))
+            return false;
+        if(tag == org_eclipse_tahu_protobuf_Payload_timestamp_tag)
+            template_timestamp = field;
+        else if(tag == org_eclipse_tahu_protobuf_Payload_seq_tag)
+            template_seq = field;
+        else if(tag == org_eclipse_tahu_protobuf_Payload_metrics_tag && count < m_payload.metrics_count){
+            const Metric *metric = &m_metrics[count];
+            TemplateMetric *entry = &template_metrics[count++];
+            entry->alias = metric->alias;
+            entry->datatype = metric->datatype;
+            entry->which_value = metric->which_value;
+            if(!find_metric_fields(&field, entry))
+                return false;
+        }
+        else
+            return false;
+    }
+    if(count != m_payload.metrics_count)
+        return false;
+
+    template_count = count;
+    template_len = stream.bytes_written;
+    return true;
+}
+
+
+// Write a varint into the template in place.  Returns false if its encoded
+// size has changed.
+static bool patch_varint(const TemplateField *field, uint64_t value){
+    uint8_t encoded[10];
+    uint8_t size = 0;
+    do{
+        encoded[size] = (value & 0x7F) | (value > 0x7F ? 0x80 : 0);
+        value >>= 7;
+        size++;
+    } while(value != 0);
+    if(size != field->size)
+        return false;
+    memcpy(&template_buffer[field->offset], encoded, size);
+    return true;
+}
+
+
+// Encode the module payload from the template, if it has the same metrics in
+// the same order as the template.  Returns false if it doesn't, or if a varint
+// has changed size.
+static bool patch_template(void){
+    if(template_len == 0 || m_payload.metrics_count != template_count ||
+       !m_payload.has_timestamp || !m_payload.has_seq)
+        return false;
+    for(pb_size_t idx = 0; idx < template_count; idx++){
+        const Metric *metric = &m_metrics[idx];
+        const TemplateMetric *entry = &template_metrics[idx];
+        if(metric->alias != entry->alias || metric->datatype != entry->datatype ||
+           metric->which_value != entry->which_value || !template_metric(metric))
+            return false;
+    }
+
+    if(!patch_varint(&template_timestamp, m_payload.timestamp) ||
+       !patch_varint(&template_seq, m_payload.seq))
+        return false;
+    for(pb_size_t idx = 0; idx < template_count; idx++){
+        const Metric *metric = &m_metrics[idx];
+        const TemplateMetric *entry = &template_metrics[idx];
+        if(!patch_varint(&entry->timestamp, metric->timestamp))
+            return false;
+        switch(metric->which_value){
+        case org_eclipse_tahu_protobuf_Payload_Metric_long_value_tag:
+            if(!patch_varint(&entry->value, metric->value.long_value))
+                return false;
+            break;
+        case org_eclipse_tahu_protobuf_Payload_Metric_boolean_value_tag:
+            if(!patch_varint(&entry->value, metric->value.boolean_value))
+                return false;
+            break;
+        case org_eclipse_tahu_protobuf_Payload_Metric_float_value_tag:
+            // Fixed32, little-endian like the processor
+            memcpy(&template_buffer[entry->value.offset], &metric->value.float_value, 4);
+            break;
+        }
+    }
+    return true;
+}
+
+
+// Encode the module payload from the payload template.
+const uint8_t * encode_payload_template(size_t *msg_len){
+    m_payload.metrics = m_metrics;
+    if(!patch_template() && !build_template())
+        return NULL;
+    *msg_len = template_len;
+    return template_buffer;
+}
+
+
+// Encode the module payload into the buffer with nanopb.
+size_t encode_payload(uint8_t *buffer, size_t buffer_length){
+    m_payload.metrics = m_metrics;
+    pb_ostream_t stream = pb_ostream_from_buffer(buffer, buffer_length);
+    if(!pb_encode(&stream, org_eclipse_tahu_protobuf_Payload_fields, &m_payload))
+        return 0;
+    return stream.bytes_written;
+}
+
+
+// Output stream callback that collects the encoded payload into chunks and
+// writes them to the broker connection.
+static bool write_stream(pb_ostream_t *stream, const pb_byte_t *buf, size_t count){
+    PubSubClient *broker = (PubSubClient *) stream->state;
+    while(count > 0){
+        size_t n = STREAM_CHUNK_SIZE - stream_chunk_used;
+        if(n > count)
+            n = count;
+        memcpy(&stream_chunk[stream_chunk_used], buf, n);
+        stream_chunk_used += n;
+        buf += n;
+        count -= n;
+        if(stream_chunk_used == STREAM_CHUNK_SIZE){
+            if(broker->write(stream_chunk, STREAM_CHUNK_SIZE) != STREAM_CHUNK_SIZE)
+                return false;
+            stream_chunk_used = 0;
+        }
+    }
+    return true;
+}
+
+
+// Encode the module payload straight into a broker connection, after its
+// publish header.  Returns false if the connection fails or the payload isn't
+// the size given in the header.
+static bool stream_payload(PubSubClient *broker, size_t msg_len){
+    pb_ostream_t stream = PB_OSTREAM_SIZING;
+    stream.callback = write_stream;
+    stream.state = broker;
+    stream.max_size = msg_len;
+    stream_chunk_used = 0;
+    if(!pb_encode(&stream, org_eclipse_tahu_protobuf_Payload_fields, &m_payload) ||
+       stream.bytes_written != msg_len)
+        return false;
+    return stream_chunk_used == 0 ||
+           broker->write(stream_chunk, stream_chunk_used) == stream_chunk_used;
+}
+
+
 // Publish the module payload with the specified topic to all the brokers.
 // Doesn't publish to brokers that we're not connected to or if the payload has
 // no metrics.  Note that this sends a duplicate of the message to each broker,
@@ -571,9 +1106,16 @@ bool publish_payload(PubSubClient *broker_array, int num_brokers, const char *to
     unsigned long long timestamp = m_gettimestamp();
     m_payload.timestamp = timestamp;
 
-    // Encode the payload to a buffer
-    sparkplugb_arduino_encoder encoder;
-    int msg_len = encoder.encode(&m_payload, encode_buffer, BIN_BUF_SIZE);
+    // Encode the payload from the template if it can be; otherwise size it
+    // for the MQTT header and encode it as it's sent
+    size_t msg_len;
+    const uint8_t *encoded = encode_payload_template(&msg_len);
+    if(encoded == NULL &&
+       !pb_get_encoded_size(&msg_len, org_eclipse_tahu_protobuf_Payload_fields, &m_payload)){
+        snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
+                 "Failed to size payload: %s", topic);
+        return false;
+    }
 
     bool published = false;
     for(int i = 0; i < num_brokers; ++i){
@@ -583,12 +1125,25 @@ bool publish_payload(PubSubClient *broker_array, int num_brokers, const char *to
         if(!broker->connected())
             continue;
 
-        // Send the message to the broker
-        if(!broker->publish(topic, encode_buffer, msg_len, false)){
+        // Send the message header, then encode the payload into the connection
+        if(!broker->beginPublish(topic, msg_len, false)){
             snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
                      "Failed to publish message to broker%d: %s", i, topic);
             continue;
         }
+        bool sent;
+        if(encoded != NULL)
+            sent = (broker->write(encoded, msg_len) == msg_len);
+        else
+            sent = stream_payload(broker, msg_len);
+        if(!sent || !broker->endPublish()){
+            // The broker has part of a message that can't be finished, so drop
+            // the connection; it's made again like any lost connection
+            snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
+                     "Failed to send message to broker%d: %s", i, topic);
+            broker->disconnect();
+            continue;
+        }
 
         // Success
         published = true;
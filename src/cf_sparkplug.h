@@ -32,7 +32,22 @@
 #define NCMD_MESSAGE_TYPE     "NCMD"            // Node command message identifier
 #define DCMD_MESSAGE_TYPE     "DCMD"            // Device command message identifier
 
-#define BIN_BUF_SIZE  2048  // Binary data buffer size for Sparkplug
+// Payloads are encoded as they're published, so their size isn't limited by a
+// buffer.  Only the will payload, which PubSubClient sends on connecting, and
+// the messages received are buffered.
+#define WILL_BUF_SIZE      256   // Encoded will (NDEATH) payload
+#define MQTT_BUF_SIZE      4096  // PubSubClient buffer, for received messages
+#define STREAM_CHUNK_SIZE  512   // Encoded payload written to the network at a time
+
+// Payloads with the same metrics as the last one, like most NDATA payloads,
+// are encoded by patching their values into the last one
+#define PAYLOAD_TEMPLATE_SIZE  2048  // Largest payload encoded from a template
+#define TEMPLATE_MAX_METRICS   64    // Most metrics in a payload template
+
+// Static storage for the metrics, so the module never allocates memory
+#define MAX_PAYLOAD_METRICS  256  // Most metrics ever sent in a single payload
+#define MAX_METRIC_ARRAYS    4    // Most arrays passed to check_metrics()
+#define MAX_INDEXED_METRICS  256  // Most metrics in all those arrays together
 
 #define NODE_TOPIC(type, node_id)               SPARKPLUG_VERSION "/" GROUP_ID "/" type "/" node_id
 #define DEVICE_TOPIC(type, node_id, device_id)  SPARKPLUG_VERSION "/" GROUP_ID "/" type "/" node_id "/" device_id
@@ -55,12 +70,86 @@ typedef struct
     void         *variable;
     bool          updated;
     unsigned long long timestamp;
+
+    // Report by exception.  An update of a FLOAT or INT64 metric is held back
+    // until it differs from the last published value by at least deadband
+    // (a percentage of that value if deadband_percent), or until max_interval
+    // milliseconds have passed since it was last published.  Zero publishes
+    // every update.
+    float         deadband;
+    bool          deadband_percent;
+    unsigned long max_interval;
+
+    // The last published value and when it was published
+    bool          published;
+    double        published_value;
+    unsigned long published_millis;
 } MetricSpec;
 
 
 typedef unsigned long long (*GetTimestamp)(void);
 
 
+// Compile-time description of a metric, for checking a metrics array with
+// static_assert().  Make one with METRIC_INFO() from the same name, alias,
+// data type and variable as the MetricSpec.
+typedef struct
+{
+    const char   *name;
+    unsigned int  alias;
+    uint32_t      datatype;
+    uint32_t      variable_datatype;  // Data type matching the variable's C type
+} MetricInfo;
+
+#define METRIC_INFO(name, alias, datatype, variable) \
+    {(name), (alias), (datatype), metric_variable_datatype(variable)}
+
+// The data type a variable of each C type is published as
+constexpr uint32_t metric_variable_datatype(const bool *)          { return METRIC_DATA_TYPE_BOOLEAN; }
+constexpr uint32_t metric_variable_datatype(const uint64_t *)      { return METRIC_DATA_TYPE_INT64; }
+constexpr uint32_t metric_variable_datatype(const int64_t *)       { return METRIC_DATA_TYPE_INT64; }
+constexpr uint32_t metric_variable_datatype(const float *)         { return METRIC_DATA_TYPE_FLOAT; }
+constexpr uint32_t metric_variable_datatype(const char * const *)  { return METRIC_DATA_TYPE_STRING; }
+
+// Return true if every metric has a name and no two metrics have the same
+// name.
+template <size_t N>
+constexpr bool metric_names_valid(const MetricInfo (&metrics)[N]){
+    for(size_t i = 0; i < N; i++){
+        if(metrics[i].name == nullptr || metrics[i].name[0] == '\0')
+            return false;
+        for(size_t j = 0; j < i; j++){
+            size_t k = 0;
+            while(metrics[i].name[k] != '\0' && metrics[i].name[k] == metrics[j].name[k])
+                k++;
+            if(metrics[i].name[k] == metrics[j].name[k])
+                return false;
+        }
+    }
+    return true;
+}
+
+// Return true if the aliases are first_alias, first_alias + 1, ... in order,
+// which makes them unique and in the range check_metrics() expects.
+template <size_t N>
+constexpr bool metric_aliases_valid(const MetricInfo (&metrics)[N], unsigned int first_alias){
+    for(size_t i = 0; i < N; i++)
+        if(metrics[i].alias != first_alias + i)
+            return false;
+    return true;
+}
+
+// Return true if every metric's data type can be published and matches its
+// variable.
+template <size_t N>
+constexpr bool metric_types_valid(const MetricInfo (&metrics)[N]){
+    for(size_t i = 0; i < N; i++)
+        if(metrics[i].datatype != metrics[i].variable_datatype)
+            return false;
+    return true;
+}
+
+
 // Module error message, set when an error occurs
 #define MAX_CF_SPARKPLUG_ERROR_LEN  200
 extern char cf_sparkplug_error[MAX_CF_SPARKPLUG_ERROR_LEN];
@@ -71,10 +160,6 @@ extern char cf_sparkplug_error[MAX_CF_SPARKPLUG_ERROR_LEN];
 // Set the callback function to get the timestamp for a payload or metric.
 void set_gettimestamp_callback(GetTimestamp timestamp_function);
 
-// Set the maximum number of metrics that will ever need to be sent in a single
-// payload.
-void set_max_metrics(unsigned int max_metrics);
-
 // Assign the specified variable pointer to the metric in the array with the
 // specified alias.  Returns false if no such metric exists or if the variable
 // pointer is null.
@@ -82,9 +167,11 @@ bool set_metric_variable(MetricSpec *metrics, int num_metrics,
                          unsigned int alias, void *variable);
 
 // Make sure all the metrics in the given array have unique alias numbers in
-// the given range, have non-empty names, and have been linked to variables.
-// Also, if necessary increase the maximum number of metrics that can be sent
-// in a single payload to the number of metrics in this array.
+// the given range, have non-empty names, and have been linked to variables,
+// and build the tables that find the array's metrics by alias, variable or
+// name in constant time.  The tables are taken from static storage, sized by
+// MAX_METRIC_ARRAYS and MAX_INDEXED_METRICS.  Arrays that haven't been checked
+// are searched instead.
 bool check_metrics(MetricSpec *metrics, int num_metrics, unsigned int end_alias);
 
 // Return a pointer to the metric in the array with the specified alias.
@@ -99,10 +186,17 @@ MetricSpec * find_metric_by_variable(MetricSpec *metrics, int num_metrics,
 
 // Return a pointer to the metric in the array that matches the received metric.
 // If the name is supplied, it is used to find a match.  Otherwise the alias is
-// used to find a match.  Returns NULL if no such metric exists, if the data
-// type doesn't match, or if the metric is read-only.
+// used to find a match.  Both are looked up in the array's index if it has
+// been checked.  Returns NULL if no such metric exists, if the data type
+// doesn't match, or if the metric is read-only.
 MetricSpec * find_received_metric(MetricSpec *metrics, int num_metrics, Metric *metric);
 
+// Set the deadband and maximum publishing interval of the metric with the
+// specified variable.  Returns false if the metric can't be found or isn't a
+// FLOAT or INT64 metric; otherwise returns true.
+bool set_metric_deadband(MetricSpec *metrics, int num_metrics, void *variable,
+                         float deadband, bool percent, unsigned long max_interval);
+
 // Mark the metric with the specified variable as updated.  This also sets its
 // timestamp.  Returns false if the metric can't be found; otherwise returns
 // true.
@@ -130,17 +224,32 @@ void set_up_ndeath_payload(void);
 // Add the metric with the specified alias or variable to the module payload.
 // If variable is non-NULL then it is used to locate the matching metric.  If
 // variable is NULL then the alias is used to locate the matching metric.  If
-// full is false, the metric is only added if it has been updated; if full is
+// full is false, the metric is only added if it has been updated outside its
+// deadband, or its maximum interval has passed; if full is
 // true the metric is added regardless and its name is included.  Returns false
 // if an error occurs; otherwise returns true.
 bool add_metric(bool full, MetricSpec *metrics, int num_metrics, void *variable,
                 unsigned int alias);
 
-// Add any updated metrics in the array to the module payload.  If full is true
+// Add any updated metrics in the array to the module payload, subject to their
+// deadbands and maximum intervals.  If full is true
 // include all the metrics, whether updated or not, together with their names.
 // Returns false if an error occurs; otherwise returns true.
 bool add_metrics(bool full, MetricSpec *metrics, int num_metrics);
 
+// Encode the module payload into the buffer with nanopb.  Returns the encoded
+// length, or zero if it doesn't fit.
+size_t encode_payload(uint8_t *buffer, size_t buffer_length);
+
+// Encode the module payload by patching its timestamps, seq and values into the
+// payload template.  The template is encoded again with nanopb when the
+// metrics, their order or the encoded size of a varint differ from the last
+// payload's.  Returns the encoded payload, valid until the next call, and sets
+// msg_len; or returns NULL if the payload can't be encoded from a template:
+// it has metric names or strings, has no seq, or doesn't fit
+// PAYLOAD_TEMPLATE_SIZE or TEMPLATE_MAX_METRICS.
+const uint8_t * encode_payload_template(size_t *msg_len);
+
 // Publish the module payload with the specified topic to all the brokers.
 // Doesn't publish to brokers that we're not connected to or if the payload has
 // no metrics.  Note that this sends a duplicate of the message to each broker,
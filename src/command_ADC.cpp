@@ -25,23 +25,27 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 
 #include "command_ADC.h"
 #include "thermistorMux_global.h"
+#include <EventResponder.h>
 
 #define CS 10
 
 /*
-Resistance at 25 degrees C
-The beta coefficient of the thermistor (usually 3000-4000)
+Thermistor fitted to every channel when THERMISTOR_CHANNEL_TYPES isn't defined.
+The resistance at 25 degrees C and beta coefficient of each part are in its
+ThermistorModel (command_ADC.h).
 */
 #ifdef thermistor_10K
-    #define THERMISTORNOMINAL 10000
-    #define BCOEFFICIENT 2.514458134e-4 // = 1/3977, B = 3997 K
-#elif thermistor_2K 
-    #define THERMISTORNOMINAL 2200   
-    #define BCOEFFICIENT 2.544529262e-4 // = 1/3930, B = 3930 K
+    #define DEFAULT_THERMISTOR_TYPE THERMISTOR_10K
+#elif defined(thermistor_2K)
+    #define DEFAULT_THERMISTOR_TYPE THERMISTOR_2K
 #else 
     #error A thermistor value must be defined.
 #endif
 
+#ifdef THERMISTOR_CHANNEL_TYPES
+static const ThermistorType channel_types[NUMBER_OF_THERMISTORS] = {THERMISTOR_CHANNEL_TYPES};
+#endif
+
 // temp. for nominal resistance (almost always 25 C = 298.15 K)
 #define TEMPERATURENOMINAL 298.15   
 
@@ -56,6 +60,10 @@ COMMAND type                           - CMD[1:0]
                                 //      01 : Device address
                                 //    0001 : Register address; Config0
                                 //      10 : Incremental write; starting at register 0x1   
+#define POINT_CONFIG1_WRITE 0b01001010 //Command byte: Incremental write starting at Config1 register
+                                //      01 : Device address
+                                //    0010 : Register address; Config1
+                                //      10 : Incremental write; starting at register 0x2
 #define POINT_MUX_WRITE 0b01011010 //CONVERSION byte; Incremental write starting at Mux register
                                 //      01 : Device address
                                 //    0110 : Register address; Mux Reg
@@ -69,20 +77,24 @@ COMMAND type                           - CMD[1:0]
                                 //     00 : Prescaler AMCLK = MCLK (default)
                                 //   1010 : Oversampling ratio; OSR = 20480 (data rate is 60 samples/sec)
                                 //     00 : Reserved = '00'
+#define CONFIG1_PRE_SHIFT 6     //     PRE[1:0] in Config1 bits 7:6
+#define CONFIG1_OSR_SHIFT 2     //     OSR[3:0] in Config1 bits 5:2
 #define CONFIG2_SET 0b10001111  // Config2 register byte: 0x03
                                 //     10 : Channel current x 1
                                 //    001 : Gain x 1
                                 //      1 : Analog input multiplexer auto-zeroing algorithm enabled
                                 //     11 : Reserved = '11'
-#define CONFIG3_SET 0b10000000  // Config3 register byte: 0x04
+#define CONFIG2_AZ_MUX 0b00000100 //   AZ_MUX bit in Config2
+#define CONFIG3_SET 0b10110011  // Config3 register byte: 0x04
                                 //     10 : One-shot conversion or one-shot cycle in SCAN mode. It sets ADC_MODE[1:0] to ‘10’ (standby) at
                                 //          the end of the conversion or at the end of the conversion cycle in SCAN mode.
-                                //     00 : 24-bit (default ADC coding): 24-bit ADC data. It does not allow overrange (ADC code locked to
-                                //          0xFFFFFF or 0x800000).
+                                //     11 : 32-bit (25-bit right justified data + Channel ID): CHID[3:0] + SGN extension (4 bits) + 24-bit ADC data.
+                                //          It allows overrange with the SGN extension.
                                 //      0 : 16-bit wide (CRC-16 only) (default)
                                 //      0 : CRC on communications disabled (default)
-                                //      0 : Digital offset cal disabled (default)
-                                //      0 : Digital gain cal diabled (default)
+                                //      1 : Digital offset cal enabled
+                                //      1 : Digital gain cal enabled
+#define CONFIG3_CAL_ENABLES 0b00000011 //  EN_OFFCAL & EN_GAINCAL bits in Config3
 #define IRQ_SET 0b00000010      // IRQ: Interrupt request register byte: 0x05
                                 //      x : Unimplemented, read as '0'
                                 //      x : ADCDATA has not been updated since last reading or last Reset (default)
@@ -105,30 +117,173 @@ COMMAND type                           - CMD[1:0]
 #define V_REF_MUX_SET 0b10111100 // Multiplexer regiter byte: 0x06, set to read Vref
                                 //   1011 : REFIN+
                                 //   1100 : REFIN- 
+#define OFFSET_MUX_SET 0b10001000 // Multiplexer regiter byte: 0x06, set to read the offset
+                                //   1000 : AGND
+                                //   1000 : AGND
 #define START_CONVERSION 0b01101000 // Fast Command
+#define POINT_SCAN_WRITE 0b01011110 //Command byte: Incremental write starting at Scan register
+                                //      01 : Device address
+                                //    0111 : Register address; Scan Reg
+                                //      10 : Incremental write; starting at register 0x07
+#define SCAN_DLY_SET 0b000      // Scan register DLY[2:0]: no delay between conversions of a scan cycle
+#define SCAN_TEMP 0x1000        // Scan register SCAN[12]: internal temperature diodes, mux 0xDE, gain 1x
+#define SCAN_DIFF_A 0x0100      // Scan register SCAN[8]: differential channel A (CH0-CH1); thermistors
+#define SCAN_MUX_MODE 0x000000 // Scan register: no channels selected, the ADC converts the MUX register input
+#define OFFSETCAL_SET 0x000000  // OffsetCal register: no offset correction until the ADC is calibrated
+#define GAINCAL_SET ADC_GAINCAL_UNITY // GainCal register: gain x 1 until the ADC is calibrated
+#define TIMER_SET 0x000000      // Timer register: no delay between scan cycles. Only used in continuous
+                                // mode; cycles are started one at a time with START_CONVERSION so that
+                                // the MOSFETs can be switched in between.
 /*
-Scan Register & Timer registers not used
-OffsetCal & GainCal registers not used
+The ADC runs in SCAN mode: the MUX register is a don't care and the ADC selects
+its own inputs for each conversion of a scan cycle, converting the selected
+channels from the highest SCAN bit to the lowest. Each conversion gives a data
+ready interrupt and its result is tagged with its channel ID.
+REFIN+/REFIN- is not one of the channels available in SCAN mode, so the ADC is
+switched to MUX mode to measure its offset and gain, which are then corrected
+by the OffsetCal & GainCal registers on every conversion.
 */
 
 //Temporary ADC data storage buffer.
 static uint32_t temp_data_buff;
 
+/*
+Chained asynchronous transfers.
+Each segment of a chain is sent in its own CS frame by the SPI DMA engine. The
+EventResponder callback runs from the DMA interrupt when a segment completes; it
+raises CS and starts the next segment, so the CPU is not involved while a
+read -> scan write -> START chain is on the bus.
+The buffers are statically allocated in DTCM, which is not cached, and are
+aligned to a cache line so DMA never shares a line with other data.
+*/
+#define ASYNC_MAX_SEGMENTS 4
+#define ASYNC_BUFFER_SIZE 32
+#define ASYNC_READ_OFFSET 0     // ADCDATA read; command byte + status byte + 32 data bits
+#define ASYNC_SCAN_OFFSET 8     // Scan register write; command byte + 24 bits
+#define ASYNC_START_OFFSET 12   // START_CONVERSION fast command
+#define ASYNC_CONFIG_OFFSET 16  // Config1 & Config2 register write; command byte + 2 bytes
+#define CS_DISABLE_TIME_NS 100  // t_CSD, minimum CS high time between frames
+
+struct AsyncSegment {
+    uint8_t offset;
+    uint8_t length;
+};
+
+static uint8_t async_tx[ASYNC_BUFFER_SIZE] __attribute__((aligned(32)));
+static uint8_t async_rx[ASYNC_BUFFER_SIZE] __attribute__((aligned(32)));
+static AsyncSegment async_segments[ASYNC_MAX_SEGMENTS];
+static int async_segment_count = 0;
+static volatile int async_segment_index = 0;
+static volatile bool async_busy = false;
+static EventResponder async_event;
+
+/*
+Starts the DMA transfer of the current segment of the queued chain.
+*/
+static void async_start_segment() {
+    const AsyncSegment &segment = async_segments[async_segment_index];
+    digitalWriteFast(CS, LOW); //Set CS to Low to begin data transfer
+    SPI.transfer(&async_tx[segment.offset], &async_rx[segment.offset], segment.length, async_event);
+}
+
+/*
+DMA completion callback, called from interrupt context. Ends the frame of the
+segment that just finished and starts the next one.
+*/
+static void async_segment_done(EventResponderRef event) {
+    digitalWriteFast(CS, HIGH); //Set CS to high to end data transfer
+    if (++async_segment_index < async_segment_count) {
+        delayNanoseconds(CS_DISABLE_TIME_NS);
+        async_start_segment();
+    }
+    else {
+        async_busy = false;
+    }
+}
+
+/*
+The blocking transfers below share the bus with the queued chains, so they must
+wait for any chain in progress to finish.
+*/
+static void wait_async_idle() {
+    while (async_busy) {
+    }
+}
+
+/*
+Scan register value for each of the scan cycles the acquisition uses.
+*/
+static uint32_t scan_register_value(ADCScanCycle cycle) {
+    uint32_t scan = SCAN_DIFF_A;
+    if (cycle == ADC_SCAN_THERMISTOR_AND_INTERNAL_TEMP) {
+        scan |= SCAN_TEMP;
+    }
+    return ((uint32_t)SCAN_DLY_SET << 21) | scan;
+}
+
+/*
+Oversampling ratios, indexed by their OSR[3:0] code (Table 5-6 of ADC datasheet).
+*/
+static const uint32_t osr_values[16] = {32, 64, 128, 256, 512, 1024, 2048, 4096, 8192,
+                                        16384, 20480, 24576, 40960, 49152, 81920, 98304};
+
+/*
+Returns the OSR[3:0] code for an oversampling ratio, or -1 if it isn't one the ADC supports.
+*/
+static int osr_code(uint32_t osr) {
+    for (int code = 0; code < 16; code++) {
+        if (osr_values[code] == osr) {
+            return code;
+        }
+    }
+    return -1;
+}
+
+/*
+Returns the PRE[1:0] code for a prescaler, or -1 if it isn't one the ADC supports.
+*/
+static int prescaler_code(uint32_t prescaler) {
+    switch (prescaler) {
+    case 1: return 0b00;
+    case 2: return 0b01;
+    case 4: return 0b10;
+    case 8: return 0b11;
+    default: return -1;
+    }
+}
+
+MCP3561 mcp3561;
+
 /*
 Initializes ADC with desired settings(defined above). 
 */
-bool initADC() {
-    
+bool MCP3561::begin() {
+
+    async_event.attachImmediate(async_segment_done);
+    registers[MCP3561_CONFIG0] = CONFIG0_SET;
+    registers[MCP3561_CONFIG1] = CONFIG1_SET;
+    registers[MCP3561_CONFIG2] = CONFIG2_SET;
+    registers[MCP3561_CONFIG3] = CONFIG3_SET;
+    registers[MCP3561_IRQ] = IRQ_SET;
+    registers[MCP3561_MUX] = THERM_MUX_SET;
+    registers[MCP3561_SCAN] = scan_register_value(ADC_SCAN_THERMISTOR);
+    registers[MCP3561_TIMER] = TIMER_SET;
+    registers[MCP3561_OFFSETCAL] = OFFSETCAL_SET;
+    registers[MCP3561_GAINCAL] = GAINCAL_SET;
+
+    wait_async_idle();
     digitalWrite(CS, LOW); //Set CS to Low to begin data transfer
     //ADC offers incremental write feature, after one register is written, moves on to
     //the next in the incremental write loop. (see figure 6-3 of ADC datasheet).
     SPI.transfer(POINT_CONFIG0_WRITE); //ADC Command byte; Incremental write starting at reg 0x01
-    SPI.transfer(CONFIG0_SET);
-    SPI.transfer(CONFIG1_SET);
-    SPI.transfer(CONFIG2_SET);
-    SPI.transfer(CONFIG3_SET);
-    SPI.transfer(IRQ_SET);
-    SPI.transfer(THERM_MUX_SET);
+    for (int reg = MCP3561_CONFIG0; reg <= MCP3561_MUX; reg++) {
+        SPI.transfer(uint8_t(registers[reg]));
+    }
+    for (int reg = MCP3561_SCAN; reg <= MCP3561_GAINCAL; reg++) {
+        SPI.transfer(uint8_t(registers[reg] >> 16)); //Scan, Timer, OffsetCal & GainCal registers, 24 bits
+        SPI.transfer(uint8_t(registers[reg] >> 8));
+        SPI.transfer(uint8_t(registers[reg]));
+    }
     digitalWrite(CS, HIGH); //Set CS to high to end data transfer
     delay(10);
 
@@ -136,78 +291,299 @@ bool initADC() {
 }
 
 /*
-Set Mux inputs to internal temperature probes.
+Starts/Restarts conversion to gather new data.
+In SCAN mode this starts a complete scan cycle.
 */
-void  setADCInternalTempRead() {
+void MCP3561::start_conversion(){
+    wait_async_idle();
     digitalWrite(CS, LOW); //Set CS to Low to begin data transfer
-    SPI.transfer(POINT_MUX_WRITE); //Command byte - set register address to 0x06; MUX Register
-    SPI.transfer(ADC_TEMP_MUX_SET); //Set Mux register to read internal ADC temp
-    delay(1);
-    digitalWrite(CS, HIGH); //Set CS to high to end data transfer  
+    SPI.transfer(START_CONVERSION); //Restart conversion fast command to gather new data. 
+    digitalWrite(CS, HIGH); //Set CS to high to end data transfer
 }
 
 /*
-Sets Mux inputs to ch0/ch1; thermistors.
+Reads and converts the last conversion result. channel_id is set to the
+channel ID the result is tagged with (ADC_CHID_*). A thermistor result is
+converted with the model fitted to thermistor (0 to NUMBER_OF_THERMISTORS - 1).
+Returns NAN if the result is saturated, as it is for an open or shorted
+thermistor.
 */
-void setThermistorMuxRead() {
+float MCP3561::read_data(uint8_t* channel_id, int thermistor) {
+    wait_async_idle();
     digitalWrite(CS, LOW); //Set CS to Low to begin data transfer
-    SPI.transfer(POINT_MUX_WRITE); //Command byte - set register address to 0x06; Mux Register
-    SPI.transfer(THERM_MUX_SET); //Set Mux to original settings; CH0 & CH1 inputs
-    delay(1);
+    SPI.transfer(ADCDATA_READ); //Read ADC_DATA register, status byte is clocked out with the command
+    temp_data_buff = SPI.transfer32(0); //Saves output (channel ID + SGN extension + 24 data bits) on a uint32 buffer.
     digitalWrite(CS, HIGH); //Set CS to high to end data transfer
+
+    uint32_t code;
+    if (!decode(temp_data_buff, channel_id, &code)) {
+        return NAN;
+    }
+    return convert(*channel_id, thermistor, code);
 }
 
 /*
-Starts/Restarts conversion to gather new data.
+Queues an optional ADCDATA read, an optional Config1/Config2 write, an optional
+Scan register write and an optional START_CONVERSION fast command as one chain
+that completes in the background. next_settings must have been checked with
+ADC_valid_settings(). The register writes are left out of the chain when the
+shadow registers show the ADC already has those values.
+The result is collected with read_queued_data() once transfer_busy() returns
+false.
+Returns false if a chain is already in progress.
+*/
+bool MCP3561::queue_transfer(bool read_data, const ADCConversionSettings* next_settings,
+                             ADCScanCycle next_cycle, bool start_next) {
+    if (async_busy) {
+        return false;
+    }
+    async_segment_count = 0;
+
+    if (read_data) {
+        async_tx[ASYNC_READ_OFFSET] = ADCDATA_READ;
+        memset(&async_tx[ASYNC_READ_OFFSET + 1], 0, 4);
+        async_segments[async_segment_count++] = {ASYNC_READ_OFFSET, 5};
+    }
+
+    if (next_settings != NULL) {
+        uint8_t config1 = (prescaler_code(next_settings->prescaler) << CONFIG1_PRE_SHIFT) |
+                          (osr_code(next_settings->osr) << CONFIG1_OSR_SHIFT);
+        uint8_t config2 = next_settings->auto_zero ? CONFIG2_SET : (CONFIG2_SET & ~CONFIG2_AZ_MUX);
+        if (config1 != registers[MCP3561_CONFIG1] || config2 != registers[MCP3561_CONFIG2]) {
+            registers[MCP3561_CONFIG1] = config1;
+            registers[MCP3561_CONFIG2] = config2;
+            async_tx[ASYNC_CONFIG_OFFSET] = POINT_CONFIG1_WRITE;
+            async_tx[ASYNC_CONFIG_OFFSET + 1] = config1;
+            async_tx[ASYNC_CONFIG_OFFSET + 2] = config2;
+            async_segments[async_segment_count++] = {ASYNC_CONFIG_OFFSET, 3};
+        }
+    }
+
+    if (next_cycle != ADC_SCAN_UNCHANGED && scan_register_value(next_cycle) != registers[MCP3561_SCAN]) {
+        uint32_t scan = registers[MCP3561_SCAN] = scan_register_value(next_cycle);
+        async_tx[ASYNC_SCAN_OFFSET] = POINT_SCAN_WRITE;
+        async_tx[ASYNC_SCAN_OFFSET + 1] = uint8_t(scan >> 16);
+        async_tx[ASYNC_SCAN_OFFSET + 2] = uint8_t(scan >> 8);
+        async_tx[ASYNC_SCAN_OFFSET + 3] = uint8_t(scan);
+        async_segments[async_segment_count++] = {ASYNC_SCAN_OFFSET, 4};
+    }
+
+    if (start_next) {
+        async_tx[ASYNC_START_OFFSET] = START_CONVERSION;
+        async_segments[async_segment_count++] = {ASYNC_START_OFFSET, 1};
+    }
+
+    if (async_segment_count == 0) {
+        return true;
+    }
+    async_segment_index = 0;
+    async_busy = true;
+    async_start_segment();
+    return true;
+}
+
+/*
+Returns true if the ADC supports the oversampling ratio and prescaler.
 */
-void start_conversion(){
+bool ADC_valid_settings(const ADCConversionSettings* settings) {
+    return (osr_code(settings->osr) >= 0) && (prescaler_code(settings->prescaler) >= 0);
+}
+
+/*
+Worst case time for one conversion with the given settings, using the slowest
+internal oscillator frequency (3.3 MHz). DMCLK = MCLK / (4 * PRE), and the
+conversion takes OSR3 * (OSR1 + 2) DMCLK periods (Table 5-6 of ADC datasheet),
+twice that with AZ_MUX enabled. Up to OSR 512 OSR1 is 1, so that is 3 * OSR;
+above it OSR3 is 512 or 256, so it is at most OSR + 1024.
+*/
+uint32_t ADC_max_conversion_time_us(const ADCConversionSettings* settings) {
+    uint32_t dmclk_periods = (settings->osr <= 512) ? 3 * settings->osr : settings->osr + 1024;
+    dmclk_periods *= settings->auto_zero ? 2 : 1;
+    return (dmclk_periods * 4 * settings->prescaler * 10) / 33;
+}
+
+/*
+Returns true while a queued chain is still on the bus.
+*/
+bool MCP3561::transfer_busy() const {
+    return async_busy;
+}
+
+/*
+Converts the data returned by the last chain queued with a read. Must only be
+called once transfer_busy() returns false. channel_id is set to the channel
+ID the result is tagged with (ADC_CHID_*) and thermistor selects the model, as
+for read_data(). Returns NAN if the result is saturated.
+*/
+float MCP3561::read_queued_data(uint8_t* channel_id, int thermistor) {
+    uint32_t code;
+    if (!read_queued_code(channel_id, &code)) {
+        return NAN;
+    }
+    return convert(*channel_id, thermistor, code);
+}
+
+/*
+As read_queued_data(), but returns the 24-bit code of the result without
+converting it. Returns false if the result is saturated or from a channel that
+isn't being scanned.
+*/
+bool MCP3561::read_queued_code(uint8_t* channel_id, uint32_t* code) const {
+    uint32_t data = ((uint32_t)async_rx[ASYNC_READ_OFFSET + 1] << 24) |
+                    ((uint32_t)async_rx[ASYNC_READ_OFFSET + 2] << 16) |
+                    ((uint32_t)async_rx[ASYNC_READ_OFFSET + 3] << 8) |
+                    (uint32_t)async_rx[ASYNC_READ_OFFSET + 4];
+    return decode(data, channel_id, code);
+}
+
+/*
+Number of conversions, and so data ready interrupts, in a scan cycle with the
+Scan register as last written.
+*/
+int MCP3561::scan_conversions() const {
+    return __builtin_popcount(registers[MCP3561_SCAN] & 0xFFFF);
+}
+
+/*
+Value last written to a configuration register.
+*/
+uint32_t MCP3561::shadow(MCP3561Register reg) const {
+    return registers[reg];
+}
+
+/*
+Writes one configuration register with a blocking transfer, unless the shadow
+register shows the ADC already has the value. Registers from the Scan register
+on are 24 bits.
+*/
+void MCP3561::write_register(MCP3561Register reg, uint32_t value) {
+    if (registers[reg] == value) {
+        return;
+    }
+    registers[reg] = value;
+    wait_async_idle();
     digitalWrite(CS, LOW); //Set CS to Low to begin data transfer
-    SPI.transfer(START_CONVERSION); //Restart conversion fast command to gather new data. 
+    SPI.transfer(0b01000010 | (reg << 2)); //Command byte: Incremental write starting at reg
+    if (reg >= MCP3561_SCAN) {
+        SPI.transfer(uint8_t(value >> 16));
+        SPI.transfer(uint8_t(value >> 8));
+    }
+    SPI.transfer(uint8_t(value));
     digitalWrite(CS, HIGH); //Set CS to high to end data transfer
 }
 
-float read_ADCDATA() {
+/*
+Switches the ADC to MUX mode with digital calibration off, and starts a
+conversion of one of the calibration inputs. The data ready interrupt signals
+the result, which is read with read_calibration_code(). Any scan cycle in
+progress is abandoned.
+*/
+void MCP3561::start_calibration_conversion(ADCCalibrationInput input) {
+    write_register(MCP3561_CONFIG3, CONFIG3_SET & ~CONFIG3_CAL_ENABLES);
+    write_register(MCP3561_SCAN, SCAN_MUX_MODE);
+    write_register(MCP3561_MUX, (input == ADC_CAL_REFERENCE) ? V_REF_MUX_SET : OFFSET_MUX_SET);
+    start_conversion();
+}
+
+/*
+Reads the result of a calibration conversion as a signed code, where +VREF is
+2^23. Returns false if the result is beyond the 25-bit overrange.
+*/
+bool MCP3561::read_calibration_code(int32_t* code) {
+    wait_async_idle();
     digitalWrite(CS, LOW); //Set CS to Low to begin data transfer
-    temp_data_buff = SPI.transfer32(0x41000000); //Send read ADC_DATA register, 32 bit command, & saves output(status byte + 24 data bytes) on a uint32 buffer. 
+    SPI.transfer(ADCDATA_READ); //Read ADC_DATA register, status byte is clocked out with the command
+    temp_data_buff = SPI.transfer32(0);
     digitalWrite(CS, HIGH); //Set CS to high to end data transfer
 
+    *code = int32_t(temp_data_buff << 7) >> 7; //Sign extend the 25-bit code
+    return (*code < 0x00FFFFFF) && (*code > -0x01000000);
+}
+
+/*
+Programs OffsetCal & GainCal from the mean codes of the offset and reference
+inputs measured without calibration, so the offset reads 0 and the reference
+2^23, and goes back to SCAN mode. Returns false, leaving the previous
+calibration, if the correction is larger than any the ADC should need.
+*/
+bool MCP3561::set_calibration(int32_t offset_code, int32_t reference_code) {
+    int32_t span = reference_code - offset_code;
+    double gain = double(ADC_GAINCAL_UNITY) / span;
+    bool valid = (abs(offset_code) <= ADC_MAX_OFFSET_CODES) && (span > 0) &&
+                 (fabs(gain - 1) <= ADC_MAX_GAIN_ERROR);
+    if (valid) {
+        write_register(MCP3561_OFFSETCAL, uint32_t(-offset_code) & 0xFFFFFF);
+        write_register(MCP3561_GAINCAL, uint32_t(lround(gain * ADC_GAINCAL_UNITY)));
+    }
+    end_calibration();
+    return valid;
+}
+
+/*
+Goes back to SCAN mode with digital calibration on, after the last calibration
+conversion. The Scan register is rewritten for the acquisition's next cycle.
+*/
+void MCP3561::end_calibration() {
+    write_register(MCP3561_MUX, THERM_MUX_SET);
+    write_register(MCP3561_CONFIG3, CONFIG3_SET);
+}
+
+/*
+Offset correction programmed into OffsetCal, in codes.
+*/
+int32_t MCP3561::offset_calibration() const {
+    return int32_t(registers[MCP3561_OFFSETCAL] << 8) >> 8;
+}
+
+/*
+Gain correction programmed into GainCal.
+*/
+float MCP3561::gain_calibration() const {
+    return float(registers[MCP3561_GAINCAL]) / ADC_GAINCAL_UNITY;
+}
+
+/*
+Splits a 32-bit result into its channel ID and 24-bit code. Returns false if the
+result is saturated or from a channel that isn't being scanned.
+*/
+bool MCP3561::decode(uint32_t data, uint8_t* channel_id, uint32_t* code) const {
     /*
-    Mask status byte and check for valid data.
-    When VIN * Gain > VREF – 1 LSb, the 24-bit ADC code (SGN+DATA[22:0]) will saturate and be locked at
-    0x7FFFFF. When VIN * Gain < -VREF, the 24-bit ADC code will saturate and be locked at 0x800000. (pg 42 ADC data sheet)
+    Output structure; CHID[3:0] + 4 bit SGN extension + 24 data bits. The channel
+    ID identifies the scan channel the result is from; the channel selected by
+    SCAN[n] has channel ID n, so it must be one the Scan register selects.
     */
-    if (((temp_data_buff & 0x00FFFFFF) == 0x007FFFFF) || ((temp_data_buff & 0x00FFFFFF) == 0x00800000)){ 
-        Serial.printf("Invalid temperature data.\n");
+    *channel_id = uint8_t(data >> 28);
+    if (!(registers[MCP3561_SCAN] & (1UL << *channel_id))) {
+        Serial.println("Invalid data return.");
+        return false;
     }
+
     /*
-    Reads status of Mux register to determine source of output data. 
-    Output structure;0xXX(status byte)XX(Mux register read data)
-    0x1701: Mux register inputs are thermistors
-    0x17DE: Mux register inputs are internal temp probes. 
-    If/else statement then sends data to appropriate conversion function. 
+    Check for valid data.
+    The 25-bit code (SGN+DATA[23:0]) allows overrange to +/-2 VREF, but the ADC is only
+    accurate to about +/-1.05 VREF (pg 43 ADC data sheet). Anything outside the 24-bit
+    range [-VREF, VREF - 1 LSb] is treated as saturated, as it was with 24-bit coding.
+    Saturated results are how the scan finds open or shorted thermistors.
     */
-    else {
-        digitalWrite(CS, LOW);//Set CS to Low to begin data transfer
-        uint16_t MUX_REG_STATUS = SPI.transfer16(0x5900);
-        digitalWrite(CS, HIGH); //Set CS to high to end data transfer
-
-        //Mask Status byte, ensure only data is sent to conversion functions. 
-        temp_data_buff = (temp_data_buff & 0x00FFFFFF);
-        if(MUX_REG_STATUS == 0x1701) {
-            return convert_thermistor_temp(temp_data_buff);
-            //return convert_thermistor_temp(0x00FFFFFB);
+    int32_t sign_extended = int32_t(data << 7) >> 7; //Sign extend the 25-bit code
+    if ((sign_extended >= 0x007FFFFF) || (sign_extended <= -0x00800000)){ 
+        return false;
+    }
+    //Mask channel ID and SGN extension, ensure only data is sent to conversion functions. 
+    *code = (data & 0x00FFFFFF);
+    return true;
+}
 
-        }
-        else if(MUX_REG_STATUS == 0x17DE) {
-           return convert_internal_temp(temp_data_buff);
-            //return convert_internal_temp(0x00FFFFFB);
-        }
-        else {
-            Serial.println("Invalid data return.");
-            return(0);
-        }
-    } 
-    return(0);
+/*
+Sends the data to the conversion function for the channel it came from.
+ADC_CHID_DIFF_A: thermistors
+ADC_CHID_TEMP: internal temp probes.
+*/
+float MCP3561::convert(uint8_t channel_id, int thermistor, uint32_t code) {
+    if(channel_id == ADC_CHID_DIFF_A) {
+        return convert_thermistor_temp(thermistor, code);
+    }
+    return convert_internal_temp(code);
 }
 
 /**
@@ -244,25 +620,282 @@ https://www.tme.eu/Document/32a31570f1c819f9b3730213e5eca259/TT7-10KC3-11.pdf
     R = measured resistance (thermistance)
     R_o = resistance at room temperature (10K or 2.2K ohms)
 **/
-float convert_thermistor_temp(uint32_t masked_therm_data){
-    float ADC_output_voltage;
+template <uint32_t R0, uint32_t Beta, uint32_t SeriesR>
+float ThermistorModel<R0, Beta, SeriesR>::temp_exact(uint32_t masked_therm_data){
+    float divider_ratio;
     float thermistance;
     int32_t therm_data = int32_t(masked_therm_data);
 
-    //Two's Complement conversion for negative ADC output data.
-    //Revisit: Might not be necessary, adc output should never be negative for thermistors??
+    //Two's Complement conversion for negative ADC output data. A working divider
+    //never gives a code of 0 or below, but a shorted input can, and that has no
+    //temperature.
     if(((masked_therm_data & 0x00FFFFFF) >> 23) == 1) { 
-        Serial.println(masked_therm_data);
         therm_data = -(int32_t((masked_therm_data ^ 0x00FFFFFF) + 1));
-        Serial.println(therm_data);
     }    
+    if(therm_data <= 0) {
+        return NAN;
+    }
    
-    //Converts ADC DATA output to measured voltage 
-    ADC_output_voltage  = (2.33 / pow(2,23)) * therm_data;
+    //Converts ADC DATA output to the fraction of the reference across the thermistor.
+    //The divider is driven by the ADC reference, so the reference voltage and its
+    //drift cancel out; the gain calibration (GainCal) only corrects the ADC's own
+    //gain error.
+    divider_ratio = therm_data / 8388608.0f;
     //Voltage divider, solving for measured thermistace
-    thermistance = (ADC_output_voltage*10000)/(2.33 - ADC_output_voltage);
-    float stein_temp_Celsius = (1/((1/TEMPERATURENOMINAL) + BCOEFFICIENT*log(thermistance/THERMISTORNOMINAL))) - 273.15;
+    thermistance = (divider_ratio*SERIES_RESISTANCE)/(1 - divider_ratio);
+    float stein_temp_Kelvin = 1/((1/TEMPERATURENOMINAL) + INVERSE_BETA*log(thermistance/NOMINAL_RESISTANCE));
+    //The few codes just above 0 come out below absolute zero; they are shorts too.
+    if(!(stein_temp_Kelvin > 0)) {
+        return NAN;
+    }
+    float stein_temp_Celsius = stein_temp_Kelvin - 273.15;
     //float stein_temp_Farenheit = (stein_temp_Celsius * (1.8)) + 32; 
 
     return(stein_temp_Celsius);
 }
+
+/*
+Fast thermistor conversion. The Beta equation is evaluated at compile time
+every THERM_TABLE_STEP codes and the temperature is interpolated linearly
+between them, so a conversion is a shift, a table read and a multiply-add
+instead of a double precision log() and two divisions. The table covers the
+codes where the interpolation error is below a few mK (about -62 C to 159 C
+for the 10K thermistor); codes outside it use the exact equation.
+The table holds micro-degrees C, so the milli-degree conversion needs no
+floating point. Each ThermistorModel has its own table.
+*/
+#define THERM_TABLE_SHIFT 11
+#define THERM_TABLE_STEP (1UL << THERM_TABLE_SHIFT)
+#define THERM_TABLE_FIRST (1UL << 17)                 // First code in the table
+#define THERM_TABLE_LAST ((1UL << 23) - (1UL << 15))  // Last code in the table
+#define THERM_TABLE_SIZE (((THERM_TABLE_LAST - THERM_TABLE_FIRST) >> THERM_TABLE_SHIFT) + 1)
+
+/*
+Natural log that can be evaluated at compile time: y = m * 2^e with m in
+[0.75, 1.5), then ln(m) = 2 atanh((m - 1) / (m + 1)) by its series.
+*/
+static constexpr double constexpr_log(double y) {
+    int e = 0;
+    while (y >= 1.5) {
+        y /= 2;
+        e++;
+    }
+    while (y < 0.75) {
+        y *= 2;
+        e--;
+    }
+    double z = (y - 1) / (y + 1);
+    double term = z;
+    double sum = 0;
+    for (int n = 1; n < 40; n += 2) {
+        sum += term / n;
+        term *= z * z;
+    }
+    return 2 * sum + e * 0.69314718055994531;
+}
+
+/*
+The same equation as ThermistorModel::temp_exact(), in double precision. The
+ADC reference cancels out of the voltage divider.
+*/
+template <class Model>
+static constexpr int32_t beta_temperature_microcelsius(uint32_t code) {
+    double ratio = code / 8388608.0;
+    double thermistance = Model::SERIES_RESISTANCE * ratio / (1 - ratio);
+    double celsius = 1 / (1 / TEMPERATURENOMINAL + Model::INVERSE_BETA * constexpr_log(thermistance / Model::NOMINAL_RESISTANCE)) - 273.15;
+    return int32_t(celsius * 1e6 + (celsius < 0 ? -0.5 : 0.5));
+}
+
+template <class Model>
+struct ThermistorTable {
+    int32_t microcelsius[THERM_TABLE_SIZE];
+
+    constexpr ThermistorTable() : microcelsius() {
+        for (uint32_t i = 0; i < THERM_TABLE_SIZE; i++) {
+            microcelsius[i] = beta_temperature_microcelsius<Model>(THERM_TABLE_FIRST + (i << THERM_TABLE_SHIFT));
+        }
+    }
+};
+
+template <class Model>
+static constexpr ThermistorTable<Model> therm_table{};
+
+/*
+Interpolates between two table entries: temp + span * fraction / THERM_TABLE_STEP,
+rounded down. On the Cortex-M7 this is one SMMLA (multiply, keep the top word and
+accumulate) with the fraction scaled to Q31; elsewhere it's a 64-bit multiply.
+*/
+static inline int32_t interpolate(int32_t temp, int32_t span, uint32_t fraction) {
+#if defined(__ARM_FEATURE_DSP)
+    int32_t result;
+    asm ("smmla %0, %1, %2, %3" : "=r" (result) : "r" (span * 2), "r" (fraction << (31 - THERM_TABLE_SHIFT)), "r" (temp));
+    return result;
+#else
+    return temp + int32_t((int64_t(span) * fraction) >> THERM_TABLE_SHIFT);
+#endif
+}
+
+/*
+Interpolates the model's table in micro-degrees C. Returns false if the code
+is outside the table.
+*/
+template <class Model>
+static bool table_microcelsius(uint32_t masked_therm_data, int32_t* microcelsius) {
+    uint32_t offset = masked_therm_data - THERM_TABLE_FIRST;  //Wraps for codes below the table
+    if (offset >= THERM_TABLE_LAST - THERM_TABLE_FIRST) {
+        return false;
+    }
+    uint32_t index = offset >> THERM_TABLE_SHIFT;
+    int32_t temp = therm_table<Model>.microcelsius[index];
+    int32_t span = therm_table<Model>.microcelsius[index + 1] - temp;
+    *microcelsius = interpolate(temp, span, offset & (THERM_TABLE_STEP - 1));
+    return true;
+}
+
+template <uint32_t R0, uint32_t Beta, uint32_t SeriesR>
+float ThermistorModel<R0, Beta, SeriesR>::temp_fast(uint32_t masked_therm_data){
+    int32_t microcelsius;
+    if (!table_microcelsius<ThermistorModel>(masked_therm_data, &microcelsius)) {
+        return temp_exact(masked_therm_data);
+    }
+    return microcelsius * 1e-6f;
+}
+
+/*
+Converts a thermistor code to milli-degrees C with integer arithmetic only,
+except for codes outside the table (see above), which use the exact equation.
+*/
+template <uint32_t R0, uint32_t Beta, uint32_t SeriesR>
+int32_t ThermistorModel<R0, Beta, SeriesR>::millicelsius(uint32_t masked_therm_data){
+    int32_t microcelsius;
+    if (!table_microcelsius<ThermistorModel>(masked_therm_data, &microcelsius)) {
+        float celsius = temp_exact(masked_therm_data);
+        return isnan(celsius) ? THERMISTOR_NO_DATA : int32_t(lroundf(celsius * 1000));
+    }
+    //Round to the nearest milli-degree; the division by a constant is a multiply.
+    return (microcelsius + (microcelsius < 0 ? -500 : 500)) / 1000;
+}
+
+template struct ThermistorModel<10000, 3977, 10000>;  // Thermistor10K
+template struct ThermistorModel<2200, 3930, 10000>;   // Thermistor2K
+
+/*
+Thermistor part fitted to a channel, 0 to NUMBER_OF_THERMISTORS - 1. This is a
+constant when every channel has the same part, so the conversions below
+reduce to a direct call.
+*/
+ThermistorType thermistor_type(int channel) {
+#ifdef THERMISTOR_CHANNEL_TYPES
+    return channel_types[channel];
+#else
+    (void) channel;
+    return DEFAULT_THERMISTOR_TYPE;
+#endif
+}
+
+/*
+Converts a thermistor code with the model fitted to the channel and the
+conversion selected by FAST_THERMISTOR_CONVERSION in thermistorMux_global.h.
+*/
+template <class Model>
+static inline float model_temp(uint32_t masked_therm_data){
+#ifdef FAST_THERMISTOR_CONVERSION
+    return Model::temp_fast(masked_therm_data);
+#else
+    return Model::temp_exact(masked_therm_data);
+#endif
+}
+
+float convert_thermistor_temp(int channel, uint32_t masked_therm_data){
+    switch (thermistor_type(channel)) {
+        case THERMISTOR_2K:
+            return model_temp<Thermistor2K>(masked_therm_data);
+        default:
+            return model_temp<Thermistor10K>(masked_therm_data);
+    }
+}
+
+/*
+Converts a thermistor code to milli-degrees C with the model fitted to the
+channel.
+*/
+int32_t convert_thermistor_millicelsius(int channel, uint32_t masked_therm_data){
+    switch (thermistor_type(channel)) {
+        case THERMISTOR_2K:
+            return Thermistor2K::millicelsius(masked_therm_data);
+        default:
+            return Thermistor10K::millicelsius(masked_therm_data);
+    }
+}
+
+/*
+Batch conversion of a pass of thermistor codes, codes[n] for thermistor n.
+The whole pass is converted in one loop with the table interpolation inlined,
+instead of a call per sample from the acquisition; the channel's part only
+selects which table is read. Codes outside the table use the exact equation.
+*/
+static const int32_t* const model_tables[NUM_THERMISTOR_TYPES] = {
+    therm_table<Thermistor10K>.microcelsius,
+    therm_table<Thermistor2K>.microcelsius,
+};
+
+static float thermistor_temp_exact(int channel, uint32_t masked_therm_data) {
+    switch (thermistor_type(channel)) {
+        case THERMISTOR_2K:
+            return Thermistor2K::temp_exact(masked_therm_data);
+        default:
+            return Thermistor10K::temp_exact(masked_therm_data);
+    }
+}
+
+/*
+Converts the codes of the channels in mask, as convert_thermistor_temp() would,
+into temps[]. The other channels are set to NAN without reading their codes,
+which are left over from earlier passes. codes and temps have
+NUMBER_OF_THERMISTORS entries.
+*/
+void convert_thermistor_batch(const uint32_t* codes, uint32_t mask, float* temps) {
+    for (uint32_t skipped = ~mask; skipped; skipped &= skipped - 1) {
+        temps[__builtin_ctz(skipped)] = NAN;
+    }
+    for (uint32_t converted = mask; converted; converted &= converted - 1) {
+        int channel = __builtin_ctz(converted);
+#ifdef FAST_THERMISTOR_CONVERSION
+        const int32_t* table = model_tables[thermistor_type(channel)];
+        uint32_t offset = codes[channel] - THERM_TABLE_FIRST;
+        if (offset < THERM_TABLE_LAST - THERM_TABLE_FIRST) {
+            uint32_t index = offset >> THERM_TABLE_SHIFT;
+            int32_t temp = table[index];
+            temps[channel] = interpolate(temp, table[index + 1] - temp, offset & (THERM_TABLE_STEP - 1)) * 1e-6f;
+            continue;
+        }
+#endif
+        temps[channel] = thermistor_temp_exact(channel, codes[channel]);
+    }
+}
+
+/*
+Converts the codes of the channels in mask, as convert_thermistor_millicelsius()
+would, into millicelsius[]. The other channels are set to THERMISTOR_NO_DATA
+without reading their codes.
+*/
+void convert_thermistor_batch_millicelsius(const uint32_t* codes, uint32_t mask, int32_t* millicelsius) {
+    for (uint32_t skipped = ~mask; skipped; skipped &= skipped - 1) {
+        millicelsius[__builtin_ctz(skipped)] = THERMISTOR_NO_DATA;
+    }
+    for (uint32_t converted = mask; converted; converted &= converted - 1) {
+        int channel = __builtin_ctz(converted);
+        const int32_t* table = model_tables[thermistor_type(channel)];
+        uint32_t offset = codes[channel] - THERM_TABLE_FIRST;
+        if (offset < THERM_TABLE_LAST - THERM_TABLE_FIRST) {
+            uint32_t index = offset >> THERM_TABLE_SHIFT;
+            int32_t temp = table[index];
+            int32_t microcelsius = interpolate(temp, table[index + 1] - temp, offset & (THERM_TABLE_STEP - 1));
+            millicelsius[channel] = (microcelsius + (microcelsius < 0 ? -500 : 500)) / 1000;
+        }
+        else {
+            float celsius = thermistor_temp_exact(channel, codes[channel]);
+            millicelsius[channel] = isnan(celsius) ? THERMISTOR_NO_DATA : int32_t(lroundf(celsius * 1000));
+        }
+    }
+}
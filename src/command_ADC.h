@@ -28,13 +28,135 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #define ADC_H
 
 
-bool initADC();
-void setADCInternalTempRead();
-void setThermistorMuxRead();
-void start_conversion();
-float read_ADCDATA();
+// Channel IDs tagging each result in SCAN mode
+#define ADC_CHID_TEMP 0xC
+#define ADC_CHID_DIFF_A 0x8
+
+// Scan cycles used by the acquisition
+enum ADCScanCycle {
+    ADC_SCAN_UNCHANGED,                     // Leave the Scan register as it is
+    ADC_SCAN_THERMISTOR,                    // Thermistor input only
+    ADC_SCAN_THERMISTOR_AND_INTERNAL_TEMP,  // Internal temperature, then the thermistor input
+};
+
+// Conversion settings that can be changed while scanning
+struct ADCConversionSettings {
+    uint32_t osr;           // Oversampling ratio, 32 to 98304
+    uint32_t prescaler;     // AMCLK prescaler, 1, 2, 4 or 8
+    bool auto_zero;         // Input multiplexer auto-zeroing
+};
+
+// Milli-degree temperature of a channel with no valid data
+#define THERMISTOR_NO_DATA INT32_MIN
+
+// Settings programmed by MCP3561::begin()
+#define ADC_DEFAULT_OSR 20480
+#define ADC_DEFAULT_PRESCALER 1
+#define ADC_DEFAULT_AUTO_ZERO true
+
+// Configuration register addresses
+enum MCP3561Register {
+    MCP3561_CONFIG0 = 0x1,
+    MCP3561_CONFIG1,
+    MCP3561_CONFIG2,
+    MCP3561_CONFIG3,
+    MCP3561_IRQ,
+    MCP3561_MUX,
+    MCP3561_SCAN,
+    MCP3561_TIMER,
+    MCP3561_OFFSETCAL,
+    MCP3561_GAINCAL,
+    MCP3561_NUM_REGISTERS
+};
+
+// Inputs converted to measure the ADC offset and gain for OFFSETCAL/GAINCAL
+enum ADCCalibrationInput {
+    ADC_CAL_OFFSET,         // Both inputs shorted to AGND
+    ADC_CAL_REFERENCE,      // REFIN+ to REFIN-, full scale
+};
+
+// GAINCAL value for a gain of 1, and the range of corrections accepted
+#define ADC_GAINCAL_UNITY 0x800000
+#define ADC_MAX_GAIN_ERROR 0.05
+#define ADC_MAX_OFFSET_CODES 0x10000
+
+/*
+Driver for the MCP3561 on the SPI bus. It keeps a shadow copy of every
+configuration register it has written, so it never reads them back, skips
+writes that wouldn't change them, and knows which channels a scan cycle
+converts.
+*/
+class MCP3561 {
+public:
+    bool begin();
+    void start_conversion();
+    float read_data(uint8_t* channel_id, int thermistor);
+    bool queue_transfer(bool read_data, const ADCConversionSettings* next_settings,
+                        ADCScanCycle next_cycle, bool start_next);
+    bool transfer_busy() const;
+    float read_queued_data(uint8_t* channel_id, int thermistor);
+    bool read_queued_code(uint8_t* channel_id, uint32_t* code) const;
+    int scan_conversions() const;
+    uint32_t shadow(MCP3561Register reg) const;
+    void start_calibration_conversion(ADCCalibrationInput input);
+    bool read_calibration_code(int32_t* code);
+    bool set_calibration(int32_t offset_code, int32_t reference_code);
+    void end_calibration();
+    int32_t offset_calibration() const;
+    float gain_calibration() const;
+
+private:
+    bool decode(uint32_t data, uint8_t* channel_id, uint32_t* code) const;
+    void write_register(MCP3561Register reg, uint32_t value);
+    static float convert(uint8_t channel_id, int thermistor, uint32_t code);
+
+    uint32_t registers[MCP3561_NUM_REGISTERS];  // Shadow copies, indexed by address
+};
+
+extern MCP3561 mcp3561;
+
+/*
+Beta equation model of a thermistor at the bottom of a voltage divider driven
+by the ADC reference:
+    R0              resistance at 25 C (ohms)
+    Beta            beta coefficient from the data sheet (K)
+    SeriesR         fixed resistor at the top of the divider (ohms)
+The conversion is ratiometric: the code is the fraction of the reference across
+the thermistor, so the reference voltage itself doesn't appear. The constants are folded at compile time and each model has its own
+conversion table, so converting with a model costs the same as the single
+thermistor_10K/thermistor_2K build did.
+*/
+template <uint32_t R0, uint32_t Beta, uint32_t SeriesR>
+struct ThermistorModel {
+    static constexpr double NOMINAL_RESISTANCE = R0;
+    static constexpr double INVERSE_BETA = 1.0 / Beta;
+    static constexpr double SERIES_RESISTANCE = SeriesR;
+
+    static float temp_exact(uint32_t masked_therm_data);
+    static float temp_fast(uint32_t masked_therm_data);
+    static int32_t millicelsius(uint32_t masked_therm_data);
+};
+
+// TT7-10KC3-11, B = 3977 K
+typedef ThermistorModel<10000, 3977, 10000> Thermistor10K;
+// 2.2K part, B = 3930 K
+typedef ThermistorModel<2200, 3930, 10000> Thermistor2K;
+
+// Thermistor parts a channel can be fitted with (see THERMISTOR_CHANNEL_TYPES)
+enum ThermistorType {
+    THERMISTOR_10K,
+    THERMISTOR_2K,
+    NUM_THERMISTOR_TYPES
+};
+
+bool ADC_valid_settings(const ADCConversionSettings* settings);
+uint32_t ADC_max_conversion_time_us(const ADCConversionSettings* settings);
 float convert_internal_temp(uint32_t);
-float convert_thermistor_temp(uint32_t);
+ThermistorType thermistor_type(int channel);
+float convert_thermistor_temp(int channel, uint32_t code);
+int32_t convert_thermistor_millicelsius(int channel, uint32_t code);
+void convert_thermistor_batch(const uint32_t* codes, uint32_t mask, float* temps);
+void convert_thermistor_batch_millicelsius(const uint32_t* codes, uint32_t mask, int32_t* millicelsius);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,389 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_calibration.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Per-channel calibration.  The calibration points are turned into a
+ * gain and offset for each segment between them, or fitted by least squares,
+ * when the calibration is loaded.  A frame is calibrated from a table with
+ * every channel's gain and offset side by side, so calibrating a sample is one
+ * multiply-add; only the channels with several segments or a polynomial do a
+ * segment search or a short polynomial.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_calibration.h"
+#include "command_ADC.h"
+
+/**
+ * @brief Set a channel to uncalibrated: one segment with gain 1 and offset 0.
+ */
+void calibration_reset(ChannelCalibration *cal) {
+    cal->degree = 0;
+    cal->segments = 1;
+    cal->segment[0].gain = 1;
+    cal->segment[0].offset = 0;
+#ifdef MILLICELSIUS_PIPELINE
+    cal->segment_fixed[0].gain_q24 = 1L << 24;
+    cal->segment_fixed[0].offset_mC = 0;
+#endif
+}
+
+/*
+Set one segment of a calibration, and its fixed point copy.  Returns false if
+the gain doesn't fit the fixed point format.
+*/
+static bool set_segment(ChannelCalibration *cal, int index, float gain, float offset) {
+    cal->segment[index].gain = gain;
+    cal->segment[index].offset = offset;
+#ifdef MILLICELSIUS_PIPELINE
+    //The gain must fit Q8.24.
+    if (!(fabsf(gain) < 127)) {
+        return false;
+    }
+    cal->segment_fixed[index].gain_q24 = lroundf(gain * (1L << 24));
+    cal->segment_fixed[index].offset_mC = lroundf(offset * 1000);
+#endif
+    return true;
+}
+
+/**
+ * @brief Compute a channel's calibration from its calibration points: the
+ * piecewise linear function through them, extended past the end points by
+ * the first and last segments.  Two points give a single gain and offset.
+ *
+ * @param cal the channel's calibration, unchanged on failure
+ * @param raw raw temperatures measured at each point; in any order
+ * @param ref reference temperatures of each point
+ * @param points number of points, 2 to CAL_MAX_POINTS
+ * @return true on success
+ * @return false if there are too few or too many points, or two points have
+ * the same raw temperature, or a temperature is NAN
+ */
+bool calibration_set_points(ChannelCalibration *cal, const float *raw, const float *ref, int points) {
+    if (points < 2 || points > CAL_MAX_POINTS) {
+        return false;
+    }
+
+    //Sort the points by raw temperature, by insertion sort.
+    float sorted_raw[CAL_MAX_POINTS];
+    float sorted_ref[CAL_MAX_POINTS];
+    for (int i = 0; i < points; i++) {
+        if (isnan(raw[i]) || isnan(ref[i])) {
+            return false;
+        }
+        int j = i;
+        while (j > 0 && sorted_raw[j - 1] > raw[i]) {
+            sorted_raw[j] = sorted_raw[j - 1];
+            sorted_ref[j] = sorted_ref[j - 1];
+            j--;
+        }
+        sorted_raw[j] = raw[i];
+        sorted_ref[j] = ref[i];
+    }
+
+    ChannelCalibration result;
+    calibration_reset(&result);
+    result.segments = points - 1;
+    for (int i = 0; i < points - 1; i++) {
+        float raw_range = sorted_raw[i + 1] - sorted_raw[i];
+        if (!(raw_range > 0)) {
+            return false;
+        }
+        float gain = (sorted_ref[i + 1] - sorted_ref[i]) / raw_range;
+        if (!set_segment(&result, i, gain, sorted_ref[i] - sorted_raw[i] * gain)) {
+            return false;
+        }
+        if (i > 0) {
+            result.breakpoint[i - 1] = sorted_raw[i];
+#ifdef MILLICELSIUS_PIPELINE
+            result.breakpoint_mC[i - 1] = lroundf(sorted_raw[i] * 1000);
+#endif
+        }
+    }
+    *cal = result;
+    return true;
+}
+
+/*
+Least-squares polynomial of the given degree through the points, in powers of
+(raw - center) where center is the mean raw temperature, which keeps the
+normal equations well conditioned.  They are solved by Gaussian elimination
+with partial pivoting.  Returns false if a temperature is NAN or there are
+fewer distinct raw temperatures than coefficients.
+*/
+static bool least_squares(const float *raw, const float *ref, int points, int degree,
+                          double *center, double *coefficient) {
+    const int n = degree + 1;
+    double mean = 0;
+    for (int i = 0; i < points; i++) {
+        if (isnan(raw[i]) || isnan(ref[i])) {
+            return false;
+        }
+        mean += raw[i];
+    }
+    mean /= points;
+
+    int distinct = 0;
+    for (int i = 0; i < points; i++) {
+        int j = 0;
+        while (j < i && raw[j] != raw[i]) {
+            j++;
+        }
+        distinct += (j == i);
+    }
+    if (distinct < n) {
+        return false;
+    }
+
+    //Normal equations, augmented with the right hand side.
+    double a[CAL_MAX_DEGREE + 1][CAL_MAX_DEGREE + 2] = {};
+    for (int i = 0; i < points; i++) {
+        double x = raw[i] - mean;
+        double power[2 * CAL_MAX_DEGREE + 1];
+        power[0] = 1;
+        for (int k = 1; k <= 2 * degree; k++) {
+            power[k] = power[k - 1] * x;
+        }
+        for (int row = 0; row < n; row++) {
+            for (int col = 0; col < n; col++) {
+                a[row][col] += power[row + col];
+            }
+            a[row][n] += ref[i] * power[row];
+        }
+    }
+
+    for (int col = 0; col < n; col++) {
+        int pivot = col;
+        for (int row = col + 1; row < n; row++) {
+            if (fabs(a[row][col]) > fabs(a[pivot][col])) {
+                pivot = row;
+            }
+        }
+        if (a[pivot][col] == 0) {
+            return false;
+        }
+        for (int k = 0; k <= n; k++) {
+            double swap = a[col][k];
+            a[col][k] = a[pivot][k];
+            a[pivot][k] = swap;
+        }
+        for (int row = col + 1; row < n; row++) {
+            double factor = a[row][col] / a[col][col];
+            for (int k = col; k <= n; k++) {
+                a[row][k] -= factor * a[col][k];
+            }
+        }
+    }
+    for (int row = n - 1; row >= 0; row--) {
+        double sum = a[row][n];
+        for (int k = row + 1; k < n; k++) {
+            sum -= a[row][k] * coefficient[k];
+        }
+        coefficient[row] = sum / a[row][row];
+        if (!isfinite(coefficient[row])) {
+            return false;
+        }
+    }
+    *center = mean;
+    return true;
+}
+
+/**
+ * @brief Compute a channel's calibration by fitting a function to its
+ * calibration points.  The fit is done once, here; applying it is the same
+ * multiply-add as the piecewise calibration for CAL_FIT_PIECEWISE and
+ * CAL_FIT_LINEAR, or a short polynomial for the higher degrees.
+ *
+ * @param cal the channel's calibration, unchanged on failure
+ * @param raw raw temperatures measured at each point
+ * @param ref reference temperatures of each point
+ * @param points number of points, up to CAL_MAX_POINTS
+ * @param fit the CalibrationFit
+ * @return true on success
+ * @return false if the fit is invalid, there are too few points for it or
+ * the points can't be fitted
+ */
+bool calibration_fit(ChannelCalibration *cal, const float *raw, const float *ref, int points, uint32_t fit) {
+    if (fit == CAL_FIT_PIECEWISE) {
+        return calibration_set_points(cal, raw, ref, points);
+    }
+    if (fit >= NUM_CAL_FITS || points < int(fit) + 1 || points > CAL_MAX_POINTS) {
+        return false;
+    }
+
+    double center;
+    double coefficient[CAL_MAX_DEGREE + 1];
+    if (!least_squares(raw, ref, points, fit, &center, coefficient)) {
+        return false;
+    }
+
+    ChannelCalibration result;
+    calibration_reset(&result);
+    if (fit == CAL_FIT_LINEAR) {
+        if (!set_segment(&result, 0, coefficient[1], coefficient[0] - coefficient[1] * center)) {
+            return false;
+        }
+    }
+    else {
+        result.degree = fit;
+        result.center = center;
+        for (uint32_t k = 0; k <= fit; k++) {
+            result.coefficient[k] = coefficient[k];
+        }
+    }
+    *cal = result;
+    return true;
+}
+
+/*
+Segment a raw temperature falls in.  NAN falls in the first segment.
+*/
+static int segment_index(const ChannelCalibration *cal, float raw) {
+    uint32_t segment = 0;
+    while (segment + 1 < cal->segments && raw >= cal->breakpoint[segment]) {
+        segment++;
+    }
+    return segment;
+}
+
+/*
+Value of a polynomial calibration at a raw temperature by Horner's rule, and
+its slope there.
+*/
+static float polynomial(const ChannelCalibration *cal, float raw, float *slope) {
+    float x = raw - cal->center;
+    float value = cal->coefficient[cal->degree];
+    float derivative = 0;
+    for (int k = cal->degree - 1; k >= 0; k--) {
+        derivative = fmaf(derivative, x, value);
+        value = fmaf(value, x, cal->coefficient[k]);
+    }
+    *slope = derivative;
+    return value;
+}
+
+/**
+ * @brief Calibrate a raw temperature.  NAN stays NAN.
+ */
+float calibration_apply(const ChannelCalibration *cal, float raw) {
+    if (cal->degree) {
+        float slope;
+        return polynomial(cal, raw, &slope);
+    }
+    const CalibrationSegment *segment = &cal->segment[segment_index(cal, raw)];
+    return fmaf(raw, segment->gain, segment->offset);
+}
+
+/**
+ * @brief Put a channel's calibration in the table: its gain and offset if it
+ * has a single segment, otherwise the whole calibration.
+ *
+ * @param table calibration of every channel
+ * @param channel channel, 0 to NUMBER_OF_THERMISTORS - 1
+ * @param cal the channel's calibration
+ */
+void calibration_table_set(CalibrationTable *table, int channel, const ChannelCalibration *cal) {
+    uint32_t bit = 1UL << channel;
+    if (cal->degree || cal->segments > 1) {
+        table->curve[channel] = *cal;
+        table->curve_mask |= bit;
+        return;
+    }
+    table->curve_mask &= ~bit;
+    table->gain[channel] = cal->segment[0].gain;
+    table->offset[channel] = cal->segment[0].offset;
+#ifdef MILLICELSIUS_PIPELINE
+    table->gain_q24[channel] = cal->segment_fixed[0].gain_q24;
+    table->offset_mC[channel] = cal->segment_fixed[0].offset_mC;
+#endif
+}
+
+/**
+ * @brief Calibrate a frame of raw temperatures and their statistics in place.
+ * The statistics are scaled with the segment of the frame's temperature, or
+ * the slope of a polynomial there, so on a channel with several segments or a
+ * polynomial the min and max are approximate.
+ *
+ * @param table calibration of every channel
+ * @param temps temperature of each channel
+ * @param stats statistics of each channel
+ */
+void calibration_apply_frame(const CalibrationTable *table, float *temps, ChannelStats *stats) {
+    for (uint32_t linear = ~table->curve_mask; linear; linear &= linear - 1) {
+        int channel = __builtin_ctz(linear);
+        temps[channel] = fmaf(temps[channel], table->gain[channel], table->offset[channel]);
+        stats_scale(&stats[channel], table->gain[channel], table->offset[channel]);
+    }
+    for (uint32_t curves = table->curve_mask; curves; curves &= curves - 1) {
+        int channel = __builtin_ctz(curves);
+        const ChannelCalibration *cal = &table->curve[channel];
+        if (cal->degree) {
+            float slope;
+            float value = polynomial(cal, temps[channel], &slope);
+            stats_scale(&stats[channel], slope, value - slope * temps[channel]);
+            temps[channel] = value;
+            continue;
+        }
+        const CalibrationSegment *segment = &cal->segment[segment_index(cal, temps[channel])];
+        temps[channel] = fmaf(temps[channel], segment->gain, segment->offset);
+        stats_scale(&stats[channel], segment->gain, segment->offset);
+    }
+}
+
+#ifdef MILLICELSIUS_PIPELINE
+/**
+ * @brief Calibrate a raw temperature in milli-degrees C without floating
+ * point, except for a polynomial calibration.  THERMISTOR_NO_DATA stays
+ * THERMISTOR_NO_DATA.
+ */
+int32_t calibration_apply_millicelsius(const ChannelCalibration *cal, int32_t millicelsius) {
+    if (millicelsius == THERMISTOR_NO_DATA) {
+        return THERMISTOR_NO_DATA;
+    }
+    if (cal->degree) {
+        return lroundf(calibration_apply(cal, millicelsius * 0.001f) * 1000);
+    }
+    uint32_t index = 0;
+    while (index + 1 < cal->segments && millicelsius >= cal->breakpoint_mC[index]) {
+        index++;
+    }
+    const CalibrationSegmentFixed *segment = &cal->segment_fixed[index];
+    return segment->offset_mC + int32_t((int64_t(millicelsius) * segment->gain_q24 + (1L << 23)) >> 24);
+}
+
+/**
+ * @brief Calibrate a frame of raw temperatures in milli-degrees C in place, as
+ * calibration_apply_millicelsius() does for each channel.
+ *
+ * @param table calibration of every channel
+ * @param millicelsius temperature of each channel
+ */
+void calibration_apply_frame_millicelsius(const CalibrationTable *table, int32_t *millicelsius) {
+    for (uint32_t linear = ~table->curve_mask; linear; linear &= linear - 1) {
+        int channel = __builtin_ctz(linear);
+        if (millicelsius[channel] != THERMISTOR_NO_DATA) {
+            millicelsius[channel] = table->offset_mC[channel] +
+                int32_t((int64_t(millicelsius[channel]) * table->gain_q24[channel] + (1L << 23)) >> 24);
+        }
+    }
+    for (uint32_t curves = table->curve_mask; curves; curves &= curves - 1) {
+        int channel = __builtin_ctz(curves);
+        millicelsius[channel] = calibration_apply_millicelsius(&table->curve[channel], millicelsius[channel]);
+    }
+}
+#endif
@@ -0,0 +1,112 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_calibration.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Definitions and function prototypes for the per-channel calibration,
+ * precomputed as a gain and offset for each segment between calibration points,
+ * and the table of every channel's calibration applied to each frame.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_CALIBRATION_H
+#define THERMISTORMUX_CALIBRATION_H
+
+#include "thermistorMux_global.h"
+#include "thermistorMux_stats.h"
+
+// Largest number of points in a channel's calibration
+#define CAL_MAX_POINTS 8
+#define CAL_MAX_SEGMENTS (CAL_MAX_POINTS - 1)
+
+// Highest degree of a least-squares polynomial calibration
+#define CAL_MAX_DEGREE 3
+
+// Functions fitted to the calibration points.  These values are used in the
+// calibration fit metric, so don't change them.  The least-squares fits are
+// the polynomial of that degree.
+enum CalibrationFit {
+    CAL_FIT_PIECEWISE = 0,  // Straight lines through the points
+    CAL_FIT_LINEAR,         // Least-squares line, at least 2 points
+    CAL_FIT_QUADRATIC,      // Least-squares quadratic, at least 3 points
+    CAL_FIT_CUBIC,          // Least-squares cubic, at least 4 points
+    NUM_CAL_FITS
+};
+
+// Calibrated temp = gain * raw temp + offset over one segment
+typedef struct {
+    float    gain;
+    float    offset;        // Degrees C
+} CalibrationSegment;
+
+#ifdef MILLICELSIUS_PIPELINE
+// The same segment in fixed point, for milli-degree temperatures
+typedef struct {
+    int32_t  gain_q24;      // Gain in Q8.24
+    int32_t  offset_mC;     // Milli-degrees C
+} CalibrationSegmentFixed;
+#endif
+
+// Calibration for one channel.  Segment i covers the raw temperatures from
+// breakpoint[i - 1] up to breakpoint[i]; the first and last segments extend
+// past the end points.  An uncalibrated channel has one segment with gain 1
+// and offset 0.  A quadratic or cubic fit is a polynomial in
+// (raw temp - center) instead of segments.
+typedef struct {
+    uint32_t degree;                            // 2 or more for a polynomial, otherwise 0
+    float    center;                            // Degrees C
+    float    coefficient[CAL_MAX_DEGREE + 1];   // Constant term first
+    uint32_t segments;
+    float    breakpoint[CAL_MAX_SEGMENTS - 1];     // Raw temperatures, increasing
+    CalibrationSegment segment[CAL_MAX_SEGMENTS];
+#ifdef MILLICELSIUS_PIPELINE
+    int32_t  breakpoint_mC[CAL_MAX_SEGMENTS - 1];
+    CalibrationSegmentFixed segment_fixed[CAL_MAX_SEGMENTS];
+#endif
+} ChannelCalibration;
+
+// Calibration of every channel, as applied to the frames.  Most channels have a
+// single gain and offset, kept together for all the channels so a frame is one
+// multiply-add per channel.  The channels in curve_mask have several segments
+// or a polynomial instead, kept in curve[] and only read for those channels.
+typedef struct {
+    float    gain[NUMBER_OF_THERMISTORS];
+    float    offset[NUMBER_OF_THERMISTORS];     // Degrees C
+#ifdef MILLICELSIUS_PIPELINE
+    int32_t  gain_q24[NUMBER_OF_THERMISTORS];   // Gain in Q8.24
+    int32_t  offset_mC[NUMBER_OF_THERMISTORS];  // Milli-degrees C
+#endif
+    uint32_t curve_mask;                        // Bit n set if channel n uses curve[n]
+    ChannelCalibration curve[NUMBER_OF_THERMISTORS];
+} CalibrationTable;
+
+void calibration_reset(ChannelCalibration *cal);
+bool calibration_set_points(ChannelCalibration *cal, const float *raw, const float *ref, int points);
+bool calibration_fit(ChannelCalibration *cal, const float *raw, const float *ref, int points, uint32_t fit);
+float calibration_apply(const ChannelCalibration *cal, float raw);
+#ifdef MILLICELSIUS_PIPELINE
+int32_t calibration_apply_millicelsius(const ChannelCalibration *cal, int32_t millicelsius);
+#endif
+
+void calibration_table_set(CalibrationTable *table, int channel, const ChannelCalibration *cal);
+void calibration_apply_frame(const CalibrationTable *table, float *temps, ChannelStats *stats);
+#ifdef MILLICELSIUS_PIPELINE
+void calibration_apply_frame_millicelsius(const CalibrationTable *table, int32_t *millicelsius);
+#endif
+
+
+#endif
@@ -0,0 +1,218 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_filter.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Per-channel digital filters: moving boxcar, median-of-N, EMA and a
+ * short FIR.  Each channel keeps its most recent samples in a fixed size ring
+ * buffer, so no memory is allocated.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_global.h"
+#include "thermistorMux_filter.h"
+
+/*
+FIR coefficients for each length, oldest sample first. A Hann window normalized
+to unity gain; a low-pass with much lower sidelobes than the boxcar.  The
+milli-degree build uses them in Q15, adjusted to sum to exactly 1.
+*/
+static float fir_coefficients[FILTER_MAX_LENGTH + 1][FILTER_MAX_LENGTH];
+#ifdef MILLICELSIUS_PIPELINE
+static int32_t fir_coefficients_q15[FILTER_MAX_LENGTH + 1][FILTER_MAX_LENGTH];
+#endif
+
+/**
+ * @brief Compute the FIR coefficients.  Must be called before filtering.
+ */
+void filter_init() {
+    for (int length = 1; length <= FILTER_MAX_LENGTH; length++) {
+        float sum = 0;
+        for (int k = 0; k < length; k++) {
+            fir_coefficients[length][k] = 0.5 - 0.5 * cos(2 * M_PI * (k + 1) / (length + 1));
+            sum += fir_coefficients[length][k];
+        }
+        for (int k = 0; k < length; k++) {
+            fir_coefficients[length][k] /= sum;
+        }
+#ifdef MILLICELSIUS_PIPELINE
+        int32_t sum_q15 = 0;
+        for (int k = 0; k < length; k++) {
+            fir_coefficients_q15[length][k] = lroundf(fir_coefficients[length][k] * (1L << 15));
+            sum_q15 += fir_coefficients_q15[length][k];
+        }
+        fir_coefficients_q15[length][(length - 1) / 2] += (1L << 15) - sum_q15;
+#endif
+    }
+}
+
+/**
+ * @brief Check that filter settings are usable.
+ */
+bool filter_valid_settings(const FilterSettings *settings) {
+    return (settings->mode < NUM_FILTER_MODES) &&
+           (settings->length >= 1) && (settings->length <= FILTER_MAX_LENGTH) &&
+           (settings->alpha > 0) && (settings->alpha <= 1);
+}
+
+/**
+ * @brief Discard a channel's samples, e.g. after its settings are changed.
+ */
+void filter_reset(ChannelFilter *filter) {
+    filter->next = 0;
+    filter->count = 0;
+    filter->output = 0;
+#ifdef MILLICELSIUS_PIPELINE
+    filter->ema_q16 = 0;
+    filter->alpha_q16 = 0;
+#endif
+}
+
+#ifdef MILLICELSIUS_PIPELINE
+/*
+Quotient rounded to the nearest integer, halves away from zero.
+*/
+static int32_t rounded_quotient(int64_t dividend, int32_t divisor) {
+    int64_t half = (dividend < 0) ? -int64_t(divisor / 2) : int64_t(divisor / 2);
+    return int32_t((dividend + half) / divisor);
+}
+
+/*
+Value in Q(shift) rounded to the nearest integer.
+*/
+static int32_t rounded_shift(int64_t value, int shift) {
+    return int32_t((value + (int64_t(1) << (shift - 1))) >> shift);
+}
+#endif
+
+/*
+Median of the samples in the buffer, by insertion sort of a copy.
+*/
+static FilterSample median(const ChannelFilter *filter) {
+    FilterSample sorted[FILTER_MAX_LENGTH];
+    for (int i = 0; i < filter->count; i++) {
+        FilterSample sample = filter->samples[i];
+        int j = i;
+        while (j > 0 && sorted[j - 1] > sample) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = sample;
+    }
+    int mid = filter->count / 2;
+    if (filter->count % 2) {
+        return sorted[mid];
+    }
+#ifdef MILLICELSIUS_PIPELINE
+    return rounded_quotient(int64_t(sorted[mid - 1]) + sorted[mid], 2);
+#else
+    return (sorted[mid - 1] + sorted[mid]) / 2;
+#endif
+}
+
+/**
+ * @brief Add a sample to a channel's filter.  In the milli-degree build the
+ * samples and output are milli-degrees and no floating point is used.
+ *
+ * @param filter the channel's filter state
+ * @param settings the filter settings for the channel
+ * @param sample the new sample
+ * @return the filter output
+ */
+FilterSample filter_add(ChannelFilter *filter, const FilterSettings *settings, FilterSample sample) {
+    uint8_t length = settings->length;
+    bool first = (filter->count == 0);
+
+    //Store the sample, dropping the oldest once the buffer spans length samples.
+    if (filter->next >= length) {
+        filter->next = 0;
+    }
+    filter->samples[filter->next] = sample;
+    filter->next = (filter->next + 1) % length;
+    if (filter->count < length) {
+        filter->count++;
+    }
+
+#ifdef MILLICELSIUS_PIPELINE
+    int64_t sum = 0;
+#else
+    float sum = 0;
+#endif
+    switch (settings->mode) {
+    case FILTER_NONE:
+        filter->output = sample;
+        break;
+
+    case FILTER_BOXCAR:
+        for (int i = 0; i < filter->count; i++) {
+            sum += filter->samples[i];
+        }
+#ifdef MILLICELSIUS_PIPELINE
+        filter->output = rounded_quotient(sum, filter->count);
+#else
+        filter->output = sum / filter->count;
+#endif
+        break;
+
+    case FILTER_MEDIAN:
+        filter->output = median(filter);
+        break;
+
+    case FILTER_EMA:
+#ifdef MILLICELSIUS_PIPELINE
+        //Alpha is converted once, when the filter starts; settings changes reset it.
+        if (first) {
+            filter->alpha_q16 = lroundf(settings->alpha * (1L << 16));
+            filter->ema_q16 = int64_t(sample) << 16;
+        }
+        else {
+            filter->ema_q16 += ((int64_t(sample) << 16) - filter->ema_q16) * filter->alpha_q16 >> 16;
+        }
+        filter->output = rounded_shift(filter->ema_q16, 16);
+#else
+        if (first) {
+            filter->output = sample;
+        }
+        else {
+            filter->output += settings->alpha * (sample - filter->output);
+        }
+#endif
+        break;
+
+    case FILTER_FIR:
+        //Until the buffer is full, use the coefficients for the samples there are.
+        //The oldest sample is at next once the buffer is full, and at 0 until then.
+        {
+            int oldest = (filter->count < length) ? 0 : filter->next;
+#ifdef MILLICELSIUS_PIPELINE
+            const int32_t *coefficients = fir_coefficients_q15[filter->count];
+            for (int k = 0; k < filter->count; k++) {
+                sum += int64_t(coefficients[k]) * filter->samples[(oldest + k) % length];
+            }
+            filter->output = rounded_shift(sum, 15);
+#else
+            const float *coefficients = fir_coefficients[filter->count];
+            for (int k = 0; k < filter->count; k++) {
+                sum += coefficients[k] * filter->samples[(oldest + k) % length];
+            }
+            filter->output = sum;
+#endif
+        }
+        break;
+    }
+    return filter->output;
+}
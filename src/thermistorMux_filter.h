@@ -0,0 +1,81 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_filter.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Definitions and function prototypes for the per-channel digital
+ * filters applied to each pass of samples before they are decimated to frames.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_FILTER_H
+#define THERMISTORMUX_FILTER_H
+
+#include "thermistorMux_global.h"
+
+// Largest number of samples a filter can span
+#define FILTER_MAX_LENGTH 16
+
+// Filter modes.  These values are used in the filter mode metrics, so don't
+// change them.
+enum FilterMode {
+    FILTER_NONE = 0,    // Frames are the mean of their passes
+    FILTER_BOXCAR,      // Moving average of the last length samples
+    FILTER_MEDIAN,      // Median of the last length samples, rejects spikes
+    FILTER_EMA,         // Exponential moving average with weight alpha
+    FILTER_FIR,         // Hann window weighted average of the last length samples
+    NUM_FILTER_MODES
+};
+
+// Filter settings
+typedef struct {
+    uint32_t mode;      // FilterMode
+    uint32_t length;    // Samples spanned by boxcar, median and FIR, 1 to FILTER_MAX_LENGTH
+    float    alpha;     // EMA weight of each new sample, greater than 0 and up to 1
+} FilterSettings;
+
+// Samples are filtered in integers in the milli-degree build
+#ifdef MILLICELSIUS_PIPELINE
+typedef int32_t FilterSample;   // Milli-degrees C
+#else
+typedef float FilterSample;     // Degrees C
+#endif
+
+// Filter state for one channel; a ring buffer of the most recent samples
+typedef struct {
+    FilterSample samples[FILTER_MAX_LENGTH];
+    uint8_t  next;      // Where the next sample goes
+    uint8_t  count;     // Number of samples in the buffer
+    FilterSample output;    // Last filter output
+#ifdef MILLICELSIUS_PIPELINE
+    int64_t  ema_q16;   // EMA output in Q16, which keeps its fraction
+    int32_t  alpha_q16; // EMA alpha in Q16, set by the first sample
+#endif
+} ChannelFilter;
+
+// Settings used until changed
+#define FILTER_DEFAULT_MODE   FILTER_NONE
+#define FILTER_DEFAULT_LENGTH 5
+#define FILTER_DEFAULT_ALPHA  0.2
+
+void filter_init();
+bool filter_valid_settings(const FilterSettings *settings);
+void filter_reset(ChannelFilter *filter);
+FilterSample filter_add(ChannelFilter *filter, const FilterSettings *settings, FilterSample sample);
+
+
+#endif
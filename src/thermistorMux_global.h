@@ -39,7 +39,7 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 
 // Overall version of the MQTT messages.  Increment this for any change to
 // the messages: added, deleted, renamed, different type, different function.
-#define COMMS_VERSION  2
+#define COMMS_VERSION  12
 
 // Enable this to display diagnostic messages on the serial port
 #define DEBUG
@@ -48,6 +48,27 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #define thermistor_10K
 //#define thermistor_2K
 
+//For a board that mixes thermistor parts, define THERMISTOR_CHANNEL_TYPES as the
+//part fitted to each channel, THERMISTOR1 first, as ThermistorType values
+//(command_ADC.h). This overrides thermistor_10K/thermistor_2K. For example, with
+//10K parts on the first 16 channels and 2.2K parts on the rest:
+/*
+#define THERMISTOR_CHANNEL_TYPES \
+    THERMISTOR_10K, THERMISTOR_10K, THERMISTOR_10K, THERMISTOR_10K, THERMISTOR_10K, THERMISTOR_10K, THERMISTOR_10K, THERMISTOR_10K, \
+    THERMISTOR_10K, THERMISTOR_10K, THERMISTOR_10K, THERMISTOR_10K, THERMISTOR_10K, THERMISTOR_10K, THERMISTOR_10K, THERMISTOR_10K, \
+    THERMISTOR_2K,  THERMISTOR_2K,  THERMISTOR_2K,  THERMISTOR_2K,  THERMISTOR_2K,  THERMISTOR_2K,  THERMISTOR_2K,  THERMISTOR_2K, \
+    THERMISTOR_2K,  THERMISTOR_2K,  THERMISTOR_2K,  THERMISTOR_2K,  THERMISTOR_2K,  THERMISTOR_2K,  THERMISTOR_2K,  THERMISTOR_2K
+*/
+
+//Convert thermistor codes with the interpolated table instead of evaluating the
+//Beta equation for every sample (see ThermistorModel::temp_fast()).
+#define FAST_THERMISTOR_CONVERSION
+
+//Publish the thermistor temperatures as integer milli-degrees C, converted,
+//averaged and calibrated without floating point, instead of as floats in
+//degrees C.
+//#define MILLICELSIUS_PIPELINE
+
 //TODO: add TEST flag maybe?
 
 #define TEENSY_4_1
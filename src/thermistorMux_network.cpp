@@ -30,6 +30,8 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #include "thermistorMux_hardware.h"
 #include "thermistorMux_global.h"
 #include "thermistor_Mux.h"
+#include "thermistorMux_scan.h"
+#include "thermistorMux_calibration.h"
 #include "cf_sparkplug.h"
 #include <NativeEthernet.h>
 #include <PubSubClient.h>
@@ -51,6 +53,17 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #define DNS 128, 96, 11, 233
 #define NUM_BROKERS  1
 
+// Minimum time between attempts to reconnect to a broker.  Connecting blocks
+// until the broker answers or times out, so don't hold up acquisition by
+// retrying on every pass through loop().
+#define BROKER_RETRY_INTERVAL_MS  5000
+
+// Default report by exception settings for the temperature metrics.  A
+// temperature is only published when it has changed by the deadband (°C) since
+// it was last published, or when the heartbeat interval (ms) has passed.
+#define DEFAULT_TEMPERATURE_DEADBAND   0.01
+#define DEFAULT_HEARTBEAT_INTERVAL_MS  10000
+
 #if defined(production_TEST)
 // MQTT broker definitions: TBD
 //Nestors office mosquitto broker
@@ -101,6 +114,8 @@ static NTPClient ntp(ntpUDP, ntpIP);
 // MQTT variables
 static EthernetClient enet[NUM_BROKERS];
 static PubSubClient m_broker[NUM_BROKERS];
+static unsigned long m_lastConnectAttempt[NUM_BROKERS] = {0};
+static bool          m_connectAttempted[NUM_BROKERS]   = {false};
 
 // Sparkplug node and topic names
 static String node_id        = NODE_ID_TEMPLATE;
@@ -121,60 +136,159 @@ static uint64_t m_commsVersion        = COMMS_VERSION;
 static const char *m_firmwareVersion  = MUX_VERSION_COMPLETE;
 static float    m_calTemp1            = {0.0};
 static float    m_calTemp2            = {0.0};
+static float    m_calPoint            = {0.0};
+static uint64_t m_calFit              = 0;
+static uint64_t m_calPoints           = 0;
+static uint64_t m_calSamples          = CAL_DEFAULT_SAMPLES;
+static float    m_calProgress         = 0.0;
+static float    m_calNoise            = 0.0;
+static bool     m_adcCalibrate        = false;
+static float    m_adcOffsetCorrection = 0.0;
+static float    m_adcGainCorrection   = 1.0;
+#ifdef MILLICELSIUS_PIPELINE
+#define THERMISTOR_DATA_TYPE  METRIC_DATA_TYPE_INT64
+#define THERMISTOR_UNITS_PER_DEGREE  1000
+static const char *m_units            = "m°C";// The user units
+static uint64_t m_THERMISTOR[NUMBER_OF_THERMISTORS] = {0};
+#else
+#define THERMISTOR_DATA_TYPE  METRIC_DATA_TYPE_FLOAT
+#define THERMISTOR_UNITS_PER_DEGREE  1
 static const char *m_units            = "°C";// The user units
 static float    m_THERMISTOR[NUMBER_OF_THERMISTORS] = {0.0};
+#endif
 static float    m_ADC_temperature     = 0.0;
+static uint64_t m_groupOSR[SCAN_CHANNEL_GROUPS]       = {0};
+static uint64_t m_groupPrescaler[SCAN_CHANNEL_GROUPS] = {0};
+static bool     m_groupAutoZero[SCAN_CHANNEL_GROUPS]  = {false};
+static uint64_t m_filterMode[SCAN_CHANNEL_GROUPS]     = {0};
+static uint64_t m_filterLength[SCAN_CHANNEL_GROUPS]   = {0};
+static float    m_filterAlpha[SCAN_CHANNEL_GROUPS]    = {0.0};
+static_assert(SCAN_CHANNEL_GROUPS == 4, "NodeMetrics has ADC and filter settings for 4 channel groups");
+static bool     m_publishStats        = false;
+static float    m_statsStdDev[NUMBER_OF_THERMISTORS] = {0.0};
+static float    m_statsMin[NUMBER_OF_THERMISTORS]    = {0.0};
+static float    m_statsMax[NUMBER_OF_THERMISTORS]    = {0.0};
+static uint64_t m_statsCount[NUMBER_OF_THERMISTORS]  = {0};
+static float    m_temperatureDeadband = DEFAULT_TEMPERATURE_DEADBAND;
+static uint64_t m_channelEnableMask   = SCAN_ALL_CHANNELS;
+static uint64_t m_channelFaultMask    = 0;
+static uint64_t m_heartbeatInterval   = DEFAULT_HEARTBEAT_INTERVAL_MS;
+static uint64_t m_breakBeforeMake     = 0;
+static uint64_t m_groupSettleTime[SCAN_CHANNEL_GROUPS] = {0};
+
+// Apply M(X, n) for each thermistor number n
+#define FOR_EACH_THERMISTOR(M, X) \
+    M(X, 1)  M(X, 2)  M(X, 3)  M(X, 4)  M(X, 5)  M(X, 6)  M(X, 7)  M(X, 8)  \
+    M(X, 9)  M(X, 10) M(X, 11) M(X, 12) M(X, 13) M(X, 14) M(X, 15) M(X, 16) \
+    M(X, 17) M(X, 18) M(X, 19) M(X, 20) M(X, 21) M(X, 22) M(X, 23) M(X, 24) \
+    M(X, 25) M(X, 26) M(X, 27) M(X, 28) M(X, 29) M(X, 30) M(X, 31) M(X, 32)
+static_assert(NUMBER_OF_THERMISTORS == 32, "FOR_EACH_THERMISTOR lists 32 thermistors");
+
+#define THERMISTOR_METRIC(X, n) \
+    X(THERMISTOR##n, "Inputs/THERMISTOR" #n, false, THERMISTOR_DATA_TYPE, &m_THERMISTOR[n - 1])
+
+// The node metrics, in alias order: X(alias name, metric name, writable, data
+// type, variable).  The NodeMetricAlias enum and the NodeMetrics table are
+// generated from this list, so add new metrics to the end of it.
+#define NODE_METRICS(X) \
+    X(Reboot,                "Node Control/Reboot",                       true,  METRIC_DATA_TYPE_BOOLEAN, &m_nodeReboot) \
+    X(Rebirth,               "Node Control/Rebirth",                      true,  METRIC_DATA_TYPE_BOOLEAN, &m_nodeRebirth) \
+    X(NextServer,            "Node Control/Next Server",                  true,  METRIC_DATA_TYPE_BOOLEAN, &m_nodeNextServer) \
+    X(ClearCal,              "Node Control/Clear Cal Data",               true,  METRIC_DATA_TYPE_BOOLEAN, &m_nodeClearCal) \
+    X(CalibrationStatus,     "Properties/Calibration Status",             true,  METRIC_DATA_TYPE_BOOLEAN, &m_nodeCalibrated) \
+    X(CalibrationTemp1,      "Node Control/Calibration Temperature 1",    true,  METRIC_DATA_TYPE_FLOAT,   &m_calTemp1) \
+    X(CalibrationTemp2,      "Node Control/Calibration Temperature 2",    true,  METRIC_DATA_TYPE_FLOAT,   &m_calTemp2) \
+    X(CalibrationINW,        "Node Control/Calibration INW",              true,  METRIC_DATA_TYPE_BOOLEAN, &m_nodeCalibrationINW) \
+    X(CommsVersion,          "Properties/Communications Version",         false, METRIC_DATA_TYPE_INT64,   &m_commsVersion) \
+    X(FirmwareVersion,       "Properties/Firmware Version",               false, METRIC_DATA_TYPE_STRING,  &m_firmwareVersion) \
+    X(Units,                 "Properties/Units",                          false, METRIC_DATA_TYPE_STRING,  &m_units) \
+    FOR_EACH_THERMISTOR(THERMISTOR_METRIC, X) \
+    X(ADC_Temperature,       "Inputs/ADC Internal Temperature",           false, METRIC_DATA_TYPE_FLOAT,   &m_ADC_temperature) \
+    X(ADCGroup1OSR,          "Node Control/ADC Group 1 OSR",              true,  METRIC_DATA_TYPE_INT64,   &m_groupOSR[0]) \
+    X(ADCGroup1Prescaler,    "Node Control/ADC Group 1 Prescaler",        true,  METRIC_DATA_TYPE_INT64,   &m_groupPrescaler[0]) \
+    X(ADCGroup1AutoZero,     "Node Control/ADC Group 1 Auto Zero",        true,  METRIC_DATA_TYPE_BOOLEAN, &m_groupAutoZero[0]) \
+    X(ADCGroup2OSR,          "Node Control/ADC Group 2 OSR",              true,  METRIC_DATA_TYPE_INT64,   &m_groupOSR[1]) \
+    X(ADCGroup2Prescaler,    "Node Control/ADC Group 2 Prescaler",        true,  METRIC_DATA_TYPE_INT64,   &m_groupPrescaler[1]) \
+    X(ADCGroup2AutoZero,     "Node Control/ADC Group 2 Auto Zero",        true,  METRIC_DATA_TYPE_BOOLEAN, &m_groupAutoZero[1]) \
+    X(ADCGroup3OSR,          "Node Control/ADC Group 3 OSR",              true,  METRIC_DATA_TYPE_INT64,   &m_groupOSR[2]) \
+    X(ADCGroup3Prescaler,    "Node Control/ADC Group 3 Prescaler",        true,  METRIC_DATA_TYPE_INT64,   &m_groupPrescaler[2]) \
+    X(ADCGroup3AutoZero,     "Node Control/ADC Group 3 Auto Zero",        true,  METRIC_DATA_TYPE_BOOLEAN, &m_groupAutoZero[2]) \
+    X(ADCGroup4OSR,          "Node Control/ADC Group 4 OSR",              true,  METRIC_DATA_TYPE_INT64,   &m_groupOSR[3]) \
+    X(ADCGroup4Prescaler,    "Node Control/ADC Group 4 Prescaler",        true,  METRIC_DATA_TYPE_INT64,   &m_groupPrescaler[3]) \
+    X(ADCGroup4AutoZero,     "Node Control/ADC Group 4 Auto Zero",        true,  METRIC_DATA_TYPE_BOOLEAN, &m_groupAutoZero[3]) \
+    X(PublishStatistics,     "Node Control/Publish Statistics",           true,  METRIC_DATA_TYPE_BOOLEAN, &m_publishStats) \
+    X(FilterGroup1Mode,      "Node Control/Filter Group 1 Mode",          true,  METRIC_DATA_TYPE_INT64,   &m_filterMode[0]) \
+    X(FilterGroup1Length,    "Node Control/Filter Group 1 Length",        true,  METRIC_DATA_TYPE_INT64,   &m_filterLength[0]) \
+    X(FilterGroup1Alpha,     "Node Control/Filter Group 1 EMA Alpha",     true,  METRIC_DATA_TYPE_FLOAT,   &m_filterAlpha[0]) \
+    X(FilterGroup2Mode,      "Node Control/Filter Group 2 Mode",          true,  METRIC_DATA_TYPE_INT64,   &m_filterMode[1]) \
+    X(FilterGroup2Length,    "Node Control/Filter Group 2 Length",        true,  METRIC_DATA_TYPE_INT64,   &m_filterLength[1]) \
+    X(FilterGroup2Alpha,     "Node Control/Filter Group 2 EMA Alpha",     true,  METRIC_DATA_TYPE_FLOAT,   &m_filterAlpha[1]) \
+    X(FilterGroup3Mode,      "Node Control/Filter Group 3 Mode",          true,  METRIC_DATA_TYPE_INT64,   &m_filterMode[2]) \
+    X(FilterGroup3Length,    "Node Control/Filter Group 3 Length",        true,  METRIC_DATA_TYPE_INT64,   &m_filterLength[2]) \
+    X(FilterGroup3Alpha,     "Node Control/Filter Group 3 EMA Alpha",     true,  METRIC_DATA_TYPE_FLOAT,   &m_filterAlpha[2]) \
+    X(FilterGroup4Mode,      "Node Control/Filter Group 4 Mode",          true,  METRIC_DATA_TYPE_INT64,   &m_filterMode[3]) \
+    X(FilterGroup4Length,    "Node Control/Filter Group 4 Length",        true,  METRIC_DATA_TYPE_INT64,   &m_filterLength[3]) \
+    X(FilterGroup4Alpha,     "Node Control/Filter Group 4 EMA Alpha",     true,  METRIC_DATA_TYPE_FLOAT,   &m_filterAlpha[3]) \
+    X(TemperatureDeadband,   "Node Control/Temperature Deadband",         true,  METRIC_DATA_TYPE_FLOAT,   &m_temperatureDeadband) \
+    X(HeartbeatInterval,     "Node Control/Heartbeat Interval",           true,  METRIC_DATA_TYPE_INT64,   &m_heartbeatInterval) \
+    X(ChannelEnableMask,     "Node Control/Channel Enable Mask",          true,  METRIC_DATA_TYPE_INT64,   &m_channelEnableMask) \
+    X(ChannelFaultMask,      "Properties/Channel Fault Mask",             false, METRIC_DATA_TYPE_INT64,   &m_channelFaultMask) \
+    X(CalibrationPoint,      "Node Control/Calibration Point",            true,  METRIC_DATA_TYPE_FLOAT,   &m_calPoint) \
+    X(CalibrationFit,        "Node Control/Calibration Fit",              true,  METRIC_DATA_TYPE_INT64,   &m_calFit) \
+    X(CalibrationPoints,     "Properties/Calibration Points",             false, METRIC_DATA_TYPE_INT64,   &m_calPoints) \
+    X(CalibrationSamples,    "Node Control/Calibration Samples",          true,  METRIC_DATA_TYPE_INT64,   &m_calSamples) \
+    X(CalibrationProgress,   "Properties/Calibration Progress",           false, METRIC_DATA_TYPE_FLOAT,   &m_calProgress) \
+    X(CalibrationNoise,      "Properties/Calibration Noise",              false, METRIC_DATA_TYPE_FLOAT,   &m_calNoise) \
+    X(ADCCalibrate,          "Node Control/ADC Calibrate",                true,  METRIC_DATA_TYPE_BOOLEAN, &m_adcCalibrate) \
+    X(ADCOffsetCorrection,   "Properties/ADC Offset Correction",          false, METRIC_DATA_TYPE_FLOAT,   &m_adcOffsetCorrection) \
+    X(ADCGainCorrection,     "Properties/ADC Gain Correction",            false, METRIC_DATA_TYPE_FLOAT,   &m_adcGainCorrection) \
+    X(BreakBeforeMake,       "Node Control/Break Before Make",            true,  METRIC_DATA_TYPE_INT64,   &m_breakBeforeMake) \
+    X(ADCGroup1SettleTime,   "Node Control/ADC Group 1 Settle Time",      true,  METRIC_DATA_TYPE_INT64,   &m_groupSettleTime[0]) \
+    X(ADCGroup2SettleTime,   "Node Control/ADC Group 2 Settle Time",      true,  METRIC_DATA_TYPE_INT64,   &m_groupSettleTime[1]) \
+    X(ADCGroup3SettleTime,   "Node Control/ADC Group 3 Settle Time",      true,  METRIC_DATA_TYPE_INT64,   &m_groupSettleTime[2]) \
+    X(ADCGroup4SettleTime,   "Node Control/ADC Group 4 Settle Time",      true,  METRIC_DATA_TYPE_INT64,   &m_groupSettleTime[3])
+
+#define NODE_METRIC_ALIAS(id, name, writable, datatype, variable) \
+    NMA_##id,
+#define NODE_METRIC_SPEC(id, name, writable, datatype, variable) \
+    {name, NMA_##id, writable, datatype, variable, false, 0},
+#define NODE_METRIC_INFO(id, name, writable, datatype, variable) \
+    METRIC_INFO(name, NMA_##id, datatype, variable),
 
 // Alias numbers for each of the node metrics
 enum NodeMetricAlias {
     NMA_bdSeq = 0,
-    NMA_Reboot,
-    NMA_Rebirth,
-    NMA_NextServer,
-    NMA_ClearCal,
-    NMA_CalibrationStatus,
-    NMA_CalibrationTemp1,
-    NMA_CalibrationTemp2,
-    NMA_CalibrationINW,
-    NMA_CommsVersion,
-    NMA_FirmwareVersion,
-    NMA_Units,
-    NMA_THERMISTOR1,
-    NMA_THERMISTOR2,
-    NMA_THERMISTOR3,
-    NMA_THERMISTOR4,
-    NMA_THERMISTOR5,
-    NMA_THERMISTOR6,
-    NMA_THERMISTOR7,
-    NMA_THERMISTOR8,
-    NMA_THERMISTOR9,
-    NMA_THERMISTOR10,
-    NMA_THERMISTOR11,
-    NMA_THERMISTOR12,
-    NMA_THERMISTOR13,
-    NMA_THERMISTOR14,
-    NMA_THERMISTOR15,
-    NMA_THERMISTOR16,
-    NMA_THERMISTOR17,
-    NMA_THERMISTOR18,
-    NMA_THERMISTOR19,
-    NMA_THERMISTOR20,
-    NMA_THERMISTOR21,
-    NMA_THERMISTOR22,
-    NMA_THERMISTOR23,
-    NMA_THERMISTOR24,
-    NMA_THERMISTOR25,
-    NMA_THERMISTOR26,
-    NMA_THERMISTOR27,
-    NMA_THERMISTOR28,
-    NMA_THERMISTOR29,
-    NMA_THERMISTOR30,
-    NMA_THERMISTOR31,
-    NMA_THERMISTOR32,
-    NMA_ADC_Temperature,
+    NODE_METRICS(NODE_METRIC_ALIAS)
     EndNodeMetricAlias
 };
 
+// Statistics metrics for each thermistor.  These follow the node metrics, with
+// aliases from EndNodeMetricAlias, and are only published when enabled.
+enum StatsMetricOffset {
+    SMO_StdDev = 0,
+    SMO_Min,
+    SMO_Max,
+    SMO_Count,
+    NUM_STATS_PER_THERMISTOR
+};
+#define NUM_STATS_METRICS     (NUMBER_OF_THERMISTORS * NUM_STATS_PER_THERMISTOR)
+#define EndStatsMetricAlias   (EndNodeMetricAlias + NUM_STATS_METRICS)
+
+// The statistics metrics of thermistor n: X(n, offset name, metric name
+// suffix, data type, variable)
+#define THERMISTOR_STATS_METRICS(X, n) \
+    X(n, StdDev, " Std Dev", METRIC_DATA_TYPE_FLOAT, &m_statsStdDev[n - 1]) \
+    X(n, Min,    " Min",     METRIC_DATA_TYPE_FLOAT, &m_statsMin[n - 1]) \
+    X(n, Max,    " Max",     METRIC_DATA_TYPE_FLOAT, &m_statsMax[n - 1]) \
+    X(n, Count,  " Count",   METRIC_DATA_TYPE_INT64, &m_statsCount[n - 1])
+
+#define STATS_METRIC_ALIAS(n, stat) \
+    (EndNodeMetricAlias + (n - 1) * NUM_STATS_PER_THERMISTOR + SMO_##stat)
+#define STATS_METRIC_SPEC(n, stat, suffix, datatype, variable) \
+    {"Statistics/THERMISTOR" #n suffix, STATS_METRIC_ALIAS(n, stat), false, datatype, variable, false, 0},
+#define STATS_METRIC_INFO(n, stat, suffix, datatype, variable) \
+    METRIC_INFO("Statistics/THERMISTOR" #n suffix, STATS_METRIC_ALIAS(n, stat), datatype, variable),
+
 // The bdseq metric for a single broker
 static MetricSpec bdseqMetricsTemplate[] = {
     {"bdSeq", NMA_bdSeq, false, METRIC_DATA_TYPE_INT64, NULL, false, 0},
@@ -185,52 +299,31 @@ static MetricSpec bdseqMetrics[NUM_BROKERS][NUM_ELEM(bdseqMetricsTemplate)];
 
 // All node metrics
 static MetricSpec NodeMetrics[] = {
-    {"Node Control/Reboot",                      NMA_Reboot,             true, METRIC_DATA_TYPE_BOOLEAN,  &m_nodeReboot,         false, 0},
-    {"Node Control/Rebirth",                     NMA_Rebirth,            true, METRIC_DATA_TYPE_BOOLEAN,  &m_nodeRebirth,        false, 0},
-    {"Node Control/Next Server",                 NMA_NextServer,         true, METRIC_DATA_TYPE_BOOLEAN,  &m_nodeNextServer,     false, 0},
-    {"Node Control/Calibration INW",             NMA_CalibrationINW,     true, METRIC_DATA_TYPE_BOOLEAN,  &m_nodeCalibrationINW, false, 0},
-    {"Node Control/Clear Cal Data",              NMA_ClearCal,           true, METRIC_DATA_TYPE_BOOLEAN,  &m_nodeClearCal,       false, 0},
-    {"Properties/Calibration Status",            NMA_CalibrationStatus,  true, METRIC_DATA_TYPE_BOOLEAN,  &m_nodeCalibrated,     false, 0},
-    {"Node Control/Calibration Temperature 1",   NMA_CalibrationTemp1,   true, METRIC_DATA_TYPE_FLOAT,    &m_calTemp1,           false, 0},        
-    {"Node Control/Calibration Temperature 2",   NMA_CalibrationTemp2,   true, METRIC_DATA_TYPE_FLOAT,    &m_calTemp2,           false, 0},    
-    {"Properties/Communications Version",        NMA_CommsVersion,       false, METRIC_DATA_TYPE_INT64,   &m_commsVersion,       false, 0},
-    {"Properties/Firmware Version",              NMA_FirmwareVersion,    false, METRIC_DATA_TYPE_STRING,  &m_firmwareVersion,    false, 0},
-    {"Properties/Units",                         NMA_Units,              false, METRIC_DATA_TYPE_STRING,  &m_units,              false, 0},
-    {"Inputs/THERMISTOR1",                       NMA_THERMISTOR1,        false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[0],      false, 0},
-    {"Inputs/THERMISTOR2",                       NMA_THERMISTOR2,        false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[1],      false, 0},
-    {"Inputs/THERMISTOR3",                       NMA_THERMISTOR3,        false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[2],      false, 0},
-    {"Inputs/THERMISTOR4",                       NMA_THERMISTOR4,        false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[3],      false, 0},
-    {"Inputs/THERMISTOR5",                       NMA_THERMISTOR5,        false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[4],      false, 0},
-    {"Inputs/THERMISTOR6",                       NMA_THERMISTOR6,        false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[5],      false, 0},
-    {"Inputs/THERMISTOR7",                       NMA_THERMISTOR7,        false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[6],      false, 0},
-    {"Inputs/THERMISTOR8",                       NMA_THERMISTOR8,        false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[7],      false, 0},
-    {"Inputs/THERMISTOR9",                       NMA_THERMISTOR9,        false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[8],      false, 0},
-    {"Inputs/THERMISTOR10",                      NMA_THERMISTOR10,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[9],      false, 0},
-    {"Inputs/THERMISTOR11",                      NMA_THERMISTOR11,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[10],     false, 0},
-    {"Inputs/THERMISTOR12",                      NMA_THERMISTOR12,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[11],     false, 0},
-    {"Inputs/THERMISTOR13",                      NMA_THERMISTOR13,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[12],     false, 0},
-    {"Inputs/THERMISTOR14",                      NMA_THERMISTOR14,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[13],     false, 0},
-    {"Inputs/THERMISTOR15",                      NMA_THERMISTOR15,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[14],     false, 0},
-    {"Inputs/THERMISTOR16",                      NMA_THERMISTOR16,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[15],     false, 0},
-    {"Inputs/THERMISTOR17",                      NMA_THERMISTOR17,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[16],     false, 0},
-    {"Inputs/THERMISTOR18",                      NMA_THERMISTOR18,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[17],     false, 0},
-    {"Inputs/THERMISTOR19",                      NMA_THERMISTOR19,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[18],     false, 0},
-    {"Inputs/THERMISTOR20",                      NMA_THERMISTOR20,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[19],     false, 0},
-    {"Inputs/THERMISTOR21",                      NMA_THERMISTOR21,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[20],     false, 0},
-    {"Inputs/THERMISTOR22",                      NMA_THERMISTOR22,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[21],     false, 0},
-    {"Inputs/THERMISTOR23",                      NMA_THERMISTOR23,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[22],     false, 0},
-    {"Inputs/THERMISTOR24",                      NMA_THERMISTOR24,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[23],     false, 0},
-    {"Inputs/THERMISTOR25",                      NMA_THERMISTOR25,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[24],     false, 0},
-    {"Inputs/THERMISTOR26",                      NMA_THERMISTOR26,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[25],     false, 0},
-    {"Inputs/THERMISTOR27",                      NMA_THERMISTOR27,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[26],     false, 0},
-    {"Inputs/THERMISTOR28",                      NMA_THERMISTOR28,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[27],     false, 0},
-    {"Inputs/THERMISTOR29",                      NMA_THERMISTOR29,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[28],     false, 0},
-    {"Inputs/THERMISTOR30",                      NMA_THERMISTOR30,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[29],     false, 0},
-    {"Inputs/THERMISTOR31",                      NMA_THERMISTOR31,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[30],     false, 0},
-    {"Inputs/THERMISTOR32",                      NMA_THERMISTOR32,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[31],     false, 0},
-    {"Inputs/ADC Internal Temperature",          NMA_ADC_Temperature,    false, METRIC_DATA_TYPE_FLOAT,   &m_ADC_temperature,    false, 0},
+    NODE_METRICS(NODE_METRIC_SPEC)
+};
+
+// The statistics metrics
+static MetricSpec StatsMetrics[] = {
+    FOR_EACH_THERMISTOR(THERMISTOR_STATS_METRICS, STATS_METRIC_SPEC)
 };
 
+// The metric tables are checked when they're compiled, and the static storage
+// in cf_sparkplug must hold them
+static constexpr MetricInfo NodeMetricInfo[]  = { NODE_METRICS(NODE_METRIC_INFO) };
+static constexpr MetricInfo StatsMetricInfo[] = { FOR_EACH_THERMISTOR(THERMISTOR_STATS_METRICS, STATS_METRIC_INFO) };
+static_assert(metric_aliases_valid(NodeMetricInfo, NMA_bdSeq + 1), "NodeMetrics must be in NodeMetricAlias order");
+static_assert(metric_names_valid(NodeMetricInfo), "Every node metric needs a unique name");
+static_assert(metric_types_valid(NodeMetricInfo), "Node metric data types must match their variables");
+static_assert(metric_aliases_valid(StatsMetricInfo, EndNodeMetricAlias), "StatsMetrics must be in alias order");
+static_assert(metric_names_valid(StatsMetricInfo), "Every statistics metric needs a unique name");
+static_assert(metric_types_valid(StatsMetricInfo), "Statistics metric data types must match their variables");
+static_assert(NUM_ELEM(StatsMetrics) == NUM_STATS_METRICS, "StatsMetrics has every statistic of every thermistor");
+static_assert(NUM_ELEM(bdseqMetricsTemplate) + NUM_ELEM(NodeMetrics) + NUM_ELEM(StatsMetrics) <= MAX_PAYLOAD_METRICS,
+              "A birth payload has more metrics than MAX_PAYLOAD_METRICS");
+static_assert(NUM_BROKERS + 2 <= MAX_METRIC_ARRAYS, "More metrics arrays than MAX_METRIC_ARRAYS");
+static_assert(NUM_BROKERS * NUM_ELEM(bdseqMetricsTemplate) + NUM_ELEM(NodeMetrics) + NUM_ELEM(StatsMetrics) <= MAX_INDEXED_METRICS,
+              "More metrics than MAX_INDEXED_METRICS");
+
 //Verify validity of this function
 void reset_teensy(){
     WRITE_RESTART(0x5FA0004);
@@ -243,15 +336,12 @@ void reset_teensy(){
 // Publish the NBIRTH message and the DBIRTH message for any devices, with all
 // metrics specified.
 void publish_births(){
-
-    if (EEPROM.read(0) == 0x01) {
-        m_nodeCalibrated = true;
-    }
     for(int br_idx = 0; br_idx < NUM_BROKERS; br_idx++){
         // Create and publish the NBIRTH message containing the bdseq metric
         // for this broker together with all the node metrics
         set_up_nbirth_payload();
         if(!add_metrics(true, ARRAY_AND_SIZE(bdseqMetrics[br_idx])) ||
+           (m_publishStats && !add_metrics(true, ARRAY_AND_SIZE(StatsMetrics))) ||
            !publish_metrics(&m_broker[br_idx], 1, nodeBirthTopic.c_str(),
                             true, ARRAY_AND_SIZE(NodeMetrics))){
             DebugPrintNoEOL("Failed to publish NBIRTH: ");
@@ -265,6 +355,10 @@ void publish_births(){
 void publish_node_data(){
     // Publish any updated metrics in the NDATA message
     set_up_next_payload();
+    if(m_publishStats && !add_metrics(false, ARRAY_AND_SIZE(StatsMetrics))){
+        DebugPrintNoEOL("Failed to add statistics to NDATA: ");
+        DebugPrint(cf_sparkplug_error);
+    }
     if(!publish_metrics(ARRAY_AND_SIZE(m_broker), nodeDataTopic.c_str(), false,
                         ARRAY_AND_SIZE(NodeMetrics))){
         // An empty message means we aren't connected to any brokers, while the
@@ -350,6 +444,65 @@ unsigned long get_current_time(void){
 unsigned long long get_current_time_millis(void){
     return ntp.getUTCEpochMillis();
 }
+// Apply a received ADC conversion setting to its channel group.  The metrics
+// for the group are marked as updated whether or not the setting was accepted,
+// so that the settings in use are published.
+void process_adc_setting(int64_t alias, Metric *metric){
+    int offset = alias - NMA_ADCGroup1OSR;
+    int group  = offset / (NMA_ADCGroup2OSR - NMA_ADCGroup1OSR);
+    ADCConversionSettings settings = *scan_group_settings(group);
+
+    switch(alias - group * (NMA_ADCGroup2OSR - NMA_ADCGroup1OSR)){
+    case NMA_ADCGroup1OSR:
+        settings.osr = (metric->value.long_value > UINT32_MAX) ? 0 : metric->value.long_value;
+        break;
+    case NMA_ADCGroup1Prescaler:
+        settings.prescaler = (metric->value.long_value > UINT32_MAX) ? 0 : metric->value.long_value;
+        break;
+    case NMA_ADCGroup1AutoZero:
+        settings.auto_zero = metric->value.boolean_value;
+        break;
+    }
+
+    if(!set_adc_settings(group, &settings))
+        DebugPrint("Invalid ADC conversion setting received");
+    publish_adc_settings();
+}
+
+// Apply a received filter setting to its channel group, as for the ADC settings.
+void process_filter_setting(int64_t alias, Metric *metric){
+    int offset = alias - NMA_FilterGroup1Mode;
+    int group  = offset / (NMA_FilterGroup2Mode - NMA_FilterGroup1Mode);
+    FilterSettings settings = *scan_group_filter(group);
+
+    switch(alias - group * (NMA_FilterGroup2Mode - NMA_FilterGroup1Mode)){
+    case NMA_FilterGroup1Mode:
+        settings.mode = (metric->value.long_value > UINT32_MAX) ? (uint32_t)NUM_FILTER_MODES : metric->value.long_value;
+        break;
+    case NMA_FilterGroup1Length:
+        settings.length = (metric->value.long_value > UINT32_MAX) ? 0 : metric->value.long_value;
+        break;
+    case NMA_FilterGroup1Alpha:
+        settings.alpha = metric->value.float_value;
+        break;
+    }
+
+    if(!set_filter_settings(group, &settings))
+        DebugPrint("Invalid filter setting received");
+    publish_filter_settings();
+}
+
+// Apply the report by exception settings to the temperature metrics.
+void set_temperature_deadbands(void){
+    for(int i = 0; i < NUMBER_OF_THERMISTORS; i++)
+        if(!set_metric_deadband(ARRAY_AND_SIZE(NodeMetrics), &m_THERMISTOR[i],
+                                m_temperatureDeadband * THERMISTOR_UNITS_PER_DEGREE, false, m_heartbeatInterval))
+            DebugPrint(cf_sparkplug_error);
+    if(!set_metric_deadband(ARRAY_AND_SIZE(NodeMetrics), &m_ADC_temperature,
+                            m_temperatureDeadband, false, m_heartbeatInterval))
+        DebugPrint(cf_sparkplug_error);
+}
+
 // Check to see if a received message is a Node command (NCMD) message.  If it
 // is, handle it and return true, even if it's invalid; otherwise return false.
 bool process_node_cmd_message(char* topic, byte* payload, unsigned int len){
@@ -415,27 +568,18 @@ bool process_node_cmd_message(char* topic, byte* payload, unsigned int len){
             DebugPrint("Calibration status requested.");            
             break;
         case NMA_CalibrationTemp1:
-            m_nodeCalibrationINW = metric->value.boolean_value;
             m_calTemp1 = metric->value.float_value;
-            cal_thermistor(m_calTemp1, 1);
-            m_nodeCalibrated = false;
-            m_nodeCalibrationINW = true;
-            for(int br_idx = 0; br_idx < NUM_BROKERS; br_idx++){
-                set_up_next_payload();
-                publish_metrics(&m_broker[br_idx], 1, nodeBirthTopic.c_str(), true, ARRAY_AND_SIZE(NodeMetrics));
-                m_nodeCalibrationINW = false; 
-            }
+            if(!cal_thermistor(m_calTemp1, 1))
+                DebugPrint("Calibration point not captured");
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_calTemp1))
+                DebugPrint(cf_sparkplug_error);
             break;
         case NMA_CalibrationTemp2:
-            m_nodeCalibrationINW = metric->value.boolean_value;
             m_calTemp2 = metric->value.float_value;
-            if (cal_thermistor(m_calTemp2, 2)) {
-                m_nodeCalibrated = true;
-            }
-            for(int br_idx = 0; br_idx < NUM_BROKERS; br_idx++){
-                set_up_next_payload();
-                publish_metrics(&m_broker[br_idx], 1, nodeBirthTopic.c_str(), true, ARRAY_AND_SIZE(NodeMetrics));
-            }
+            if(!cal_thermistor(m_calTemp2, 2))
+                DebugPrint("Calibration point not captured");
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_calTemp2))
+                DebugPrint(cf_sparkplug_error);
             break;
         case NMA_CalibrationINW:
             m_nodeCalibrationINW = metric->value.boolean_value;
@@ -454,6 +598,99 @@ bool process_node_cmd_message(char* topic, byte* payload, unsigned int len){
             }
             DebugPrint("Calibration data has been permanently erased.");            
             break;
+        case NMA_CalibrationPoint:
+            m_calPoint = metric->value.float_value;
+            if(!cal_capture_point(m_calPoint))
+                DebugPrint("Calibration point not captured");
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_calPoint))
+                DebugPrint(cf_sparkplug_error);
+            break;
+        case NMA_CalibrationFit:
+            if(metric->value.long_value >= NUM_CAL_FITS || !cal_fit_points(metric->value.long_value))
+                DebugPrint("Invalid calibration fit received");
+            publish_calibration_points(m_calPoints, m_calFit);
+            break;
+        case NMA_ADCCalibrate:
+            if(metric->value.boolean_value){
+                scan_request_adc_calibration();
+                DebugPrint("ADC offset and gain calibration requested");
+            }
+            break;
+        case NMA_CalibrationSamples:
+            if(metric->value.long_value > CAL_MAX_SAMPLES || !cal_set_samples(metric->value.long_value))
+                DebugPrint("Invalid calibration samples received");
+            else
+                m_calSamples = metric->value.long_value;
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_calSamples))
+                DebugPrint(cf_sparkplug_error);
+            break;
+        case NMA_PublishStatistics:
+            m_publishStats = metric->value.boolean_value;
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_publishStats))
+                DebugPrint(cf_sparkplug_error);
+            // The statistics metrics are only in the NBIRTH message while they
+            // are enabled, so publish birth messages again
+            m_nodeRebirth = true;
+            break;
+        case NMA_ADCGroup1OSR:
+        case NMA_ADCGroup1Prescaler:
+        case NMA_ADCGroup1AutoZero:
+        case NMA_ADCGroup2OSR:
+        case NMA_ADCGroup2Prescaler:
+        case NMA_ADCGroup2AutoZero:
+        case NMA_ADCGroup3OSR:
+        case NMA_ADCGroup3Prescaler:
+        case NMA_ADCGroup3AutoZero:
+        case NMA_ADCGroup4OSR:
+        case NMA_ADCGroup4Prescaler:
+        case NMA_ADCGroup4AutoZero:
+            process_adc_setting(alias, metric);
+            break;
+        case NMA_TemperatureDeadband:
+            m_temperatureDeadband = (metric->value.float_value < 0) ? 0 : metric->value.float_value;
+            set_temperature_deadbands();
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_temperatureDeadband))
+                DebugPrint(cf_sparkplug_error);
+            break;
+        case NMA_HeartbeatInterval:
+            m_heartbeatInterval = (metric->value.long_value > ULONG_MAX) ? ULONG_MAX : metric->value.long_value;
+            set_temperature_deadbands();
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_heartbeatInterval))
+                DebugPrint(cf_sparkplug_error);
+            break;
+        case NMA_ChannelEnableMask:
+            if(metric->value.long_value > SCAN_ALL_CHANNELS || !set_channel_enable_mask(metric->value.long_value))
+                DebugPrint("Invalid channel enable mask received");
+            publish_channel_masks();
+            break;
+        case NMA_FilterGroup1Mode:
+        case NMA_FilterGroup1Length:
+        case NMA_FilterGroup1Alpha:
+        case NMA_FilterGroup2Mode:
+        case NMA_FilterGroup2Length:
+        case NMA_FilterGroup2Alpha:
+        case NMA_FilterGroup3Mode:
+        case NMA_FilterGroup3Length:
+        case NMA_FilterGroup3Alpha:
+        case NMA_FilterGroup4Mode:
+        case NMA_FilterGroup4Length:
+        case NMA_FilterGroup4Alpha:
+            process_filter_setting(alias, metric);
+            break;
+        case NMA_BreakBeforeMake:
+            if(metric->value.long_value > SCAN_MAX_SWITCH_US || !set_break_before_make(metric->value.long_value))
+                DebugPrint("Invalid break-before-make time received");
+            publish_switch_times();
+            break;
+        case NMA_ADCGroup1SettleTime:
+        case NMA_ADCGroup2SettleTime:
+        case NMA_ADCGroup3SettleTime:
+        case NMA_ADCGroup4SettleTime:
+            if(metric->value.long_value > SCAN_MAX_SWITCH_US ||
+               !set_settle_time(alias - NMA_ADCGroup1SettleTime, metric->value.long_value))
+                DebugPrint("Invalid settling time received");
+            publish_switch_times();
+            break;
         default:
             DebugPrintNoEOL("Unhandled Node metric alias: ");
             DebugPrint(alias);
@@ -525,15 +762,19 @@ void callback_worker(char* topic, byte* payload, unsigned int len){
 }
 
 /**
- * @brief Publish metrics for THERMISTOR channels and temperature.  Note that we
- * publish this data even if it hasn't changed because the timestamp should
- * show when the data was last read, not when it last changed.
+ * @brief Publish metrics for THERMISTOR channels and temperature.  The
+ * temperatures are reported by exception: each is only published when it has
+ * changed by more than its deadband since it was last published, or when its
+ * heartbeat interval has passed, so an unchanged reading is still published
+ * now and then to show the channel is alive.
  *
  * @param THERMISTOR_data an array of NUM_THERMISTOR_CHANNELS floats representing the averaged
  * THERMISTOR voltages
  * @param the average temperature reading
+ * @param THERMISTOR_stats an array of NUM_THERMISTOR_CHANNELS statistics of the
+ * THERMISTOR temperatures, published only if enabled
  */
-void publish_data(float* THERMISTOR_data, float ADC_temperature){
+void publish_data(const ThermistorValue* THERMISTOR_data, float ADC_temperature, const ChannelStats* THERMISTOR_stats){
     // Store new THERMISTOR data, converting from raw THERMISTOR values to user units
     for(int i = 0; i < NUMBER_OF_THERMISTORS; i++){
         m_THERMISTOR[i] = THERMISTOR_data[i];
@@ -545,6 +786,30 @@ void publish_data(float* THERMISTOR_data, float ADC_temperature){
     m_ADC_temperature = ADC_temperature;
     if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_ADC_temperature))
         DebugPrint(cf_sparkplug_error);
+
+    // Channels found open or shorted
+    if(m_channelFaultMask != scan_fault_mask())
+        publish_channel_masks();
+
+    // ADC offset and gain corrections, measured periodically
+    if(m_adcOffsetCorrection != mcp3561.offset_calibration() ||
+       m_adcGainCorrection != mcp3561.gain_calibration())
+        publish_adc_calibration();
+
+    // Store new THERMISTOR statistics
+    if(!m_publishStats)
+        return;
+    for(int i = 0; i < NUMBER_OF_THERMISTORS; i++){
+        m_statsStdDev[i] = stats_std_dev(&THERMISTOR_stats[i]);
+        m_statsMin[i]    = THERMISTOR_stats[i].min;
+        m_statsMax[i]    = THERMISTOR_stats[i].max;
+        m_statsCount[i]  = THERMISTOR_stats[i].count;
+        if(!update_metric(ARRAY_AND_SIZE(StatsMetrics), &m_statsStdDev[i]) ||
+           !update_metric(ARRAY_AND_SIZE(StatsMetrics), &m_statsMin[i]) ||
+           !update_metric(ARRAY_AND_SIZE(StatsMetrics), &m_statsMax[i]) ||
+           !update_metric(ARRAY_AND_SIZE(StatsMetrics), &m_statsCount[i]))
+            DebugPrint(cf_sparkplug_error);
+    }
 }
 void publish_refs(float ref_Low, float ref_High) {
     m_calTemp1 = ref_Low;
@@ -556,6 +821,124 @@ void publish_refs(float ref_Low, float ref_High) {
 }
 
 
+/**
+ * @brief Publish whether the thermistors are calibrated.
+ */
+void publish_calibration_status(bool calibrated){
+    m_nodeCalibrated = calibrated;
+    if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_nodeCalibrated))
+        DebugPrint(cf_sparkplug_error);
+}
+
+/**
+ * @brief Publish the number of multi-point calibration points captured and
+ * the fit in use.
+ */
+void publish_calibration_points(uint32_t points, uint32_t fit){
+    m_calPoints = points;
+    if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_calPoints))
+        DebugPrint(cf_sparkplug_error);
+    m_calFit = fit;
+    if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_calFit))
+        DebugPrint(cf_sparkplug_error);
+}
+
+/**
+ * @brief Publish the progress of the calibration point being captured.
+ *
+ * @param in_work true while the point is being captured
+ * @param progress percentage of the samples captured
+ * @param noise largest standard deviation of a channel over the samples
+ * captured, degrees C
+ */
+void publish_calibration_progress(bool in_work, float progress, float noise){
+    m_nodeCalibrationINW = in_work;
+    if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_nodeCalibrationINW))
+        DebugPrint(cf_sparkplug_error);
+    m_calProgress = progress;
+    if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_calProgress))
+        DebugPrint(cf_sparkplug_error);
+    m_calNoise = noise;
+    if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_calNoise))
+        DebugPrint(cf_sparkplug_error);
+}
+
+/**
+ * @brief Publish the channels that are enabled and the channels that are
+ * faulted.
+ */
+void publish_channel_masks(void){
+    m_channelEnableMask = scan_enable_mask();
+    if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_channelEnableMask))
+        DebugPrint(cf_sparkplug_error);
+    m_channelFaultMask = scan_fault_mask();
+    if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_channelFaultMask))
+        DebugPrint(cf_sparkplug_error);
+}
+
+/**
+ * @brief Publish the offset and gain corrections programmed into the ADC.
+ */
+void publish_adc_calibration(void){
+    m_adcOffsetCorrection = mcp3561.offset_calibration();
+    if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_adcOffsetCorrection))
+        DebugPrint(cf_sparkplug_error);
+    m_adcGainCorrection = mcp3561.gain_calibration();
+    if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_adcGainCorrection))
+        DebugPrint(cf_sparkplug_error);
+}
+
+/**
+ * @brief Publish the ADC conversion settings in use for each channel group.
+ */
+void publish_adc_settings(void){
+    for(int group = 0; group < SCAN_CHANNEL_GROUPS; group++){
+        const ADCConversionSettings *settings = scan_group_settings(group);
+        m_groupOSR[group] = settings->osr;
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_groupOSR[group]))
+            DebugPrint(cf_sparkplug_error);
+        m_groupPrescaler[group] = settings->prescaler;
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_groupPrescaler[group]))
+            DebugPrint(cf_sparkplug_error);
+        m_groupAutoZero[group] = settings->auto_zero;
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_groupAutoZero[group]))
+            DebugPrint(cf_sparkplug_error);
+    }
+}
+
+/**
+ * @brief Publish the break-before-make time and the settling time of each
+ * channel group.
+ */
+void publish_switch_times(void){
+    m_breakBeforeMake = scan_break_before_make();
+    if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_breakBeforeMake))
+        DebugPrint(cf_sparkplug_error);
+    for(int group = 0; group < SCAN_CHANNEL_GROUPS; group++){
+        m_groupSettleTime[group] = scan_group_settle_time(group);
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_groupSettleTime[group]))
+            DebugPrint(cf_sparkplug_error);
+    }
+}
+
+/**
+ * @brief Publish the filter settings in use for each channel group.
+ */
+void publish_filter_settings(void){
+    for(int group = 0; group < SCAN_CHANNEL_GROUPS; group++){
+        const FilterSettings *settings = scan_group_filter(group);
+        m_filterMode[group] = settings->mode;
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_filterMode[group]))
+            DebugPrint(cf_sparkplug_error);
+        m_filterLength[group] = settings->length;
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_filterLength[group]))
+            DebugPrint(cf_sparkplug_error);
+        m_filterAlpha[group] = settings->alpha;
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_filterAlpha[group]))
+            DebugPrint(cf_sparkplug_error);
+    }
+}
+
 /**
  * @brief Updates the NTP object's state, which will periodically sync time
  * with the NTP server.
@@ -611,10 +994,8 @@ bool network_init(void){
     // Set up the metrics arrays holding the node birth/death sequence numbers
     setup_bdseq_metrics();
 
-    // We need to send at least the node metrics plus bdseq
-    set_max_metrics(NUM_ELEM(bdseqMetrics[0]) + NUM_ELEM(NodeMetrics));
-
-    // Check that the alias numbers in the metrics are valid and unique
+    // Check that the alias numbers in the metrics are valid and unique, and
+    // index them
     for(int i = 0; i < NUM_BROKERS; ++i)
         if(!check_metrics(ARRAY_AND_SIZE(bdseqMetrics[i]), NMA_bdSeq + 1)){
             DebugPrint(cf_sparkplug_error);
@@ -624,6 +1005,13 @@ bool network_init(void){
         DebugPrint(cf_sparkplug_error);
         return false;
     }
+    if(!check_metrics(ARRAY_AND_SIZE(StatsMetrics    ), EndStatsMetricAlias    )){
+        DebugPrint(cf_sparkplug_error);
+        return false;
+    }
+
+    // Only publish temperatures when they change
+    set_temperature_deadbands();
 
     // Point to our function for getting timestamps
     set_gettimestamp_callback(get_current_time_millis);
@@ -684,7 +1072,7 @@ bool network_init(void){
 
     for(int i = 0; i < NUM_BROKERS; ++i){
         m_broker[i].setCallback(callback_worker);
-        m_broker[i].setBufferSize(BIN_BUF_SIZE);
+        m_broker[i].setBufferSize(MQTT_BUF_SIZE);
     }
 
     // Network has been set up successfully
@@ -703,6 +1091,13 @@ void check_brokers(void){
     for(int i = 0; i < NUM_BROKERS; ++i){
         PubSubClient *broker = &m_broker[i];
         if(!broker->connected()){
+            // Don't retry too often
+            if(m_connectAttempted[i] &&
+               millis() - m_lastConnectAttempt[i] < BROKER_RETRY_INTERVAL_MS)
+                continue;
+            m_connectAttempted[i] = true;
+            m_lastConnectAttempt[i] = millis();
+
             // Try to connect to the broker
             if(!connect_to_broker(broker, i))
                 // Can't connect - ignore this broker
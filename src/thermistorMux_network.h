@@ -29,11 +29,28 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #ifndef THERMISTORMUX_NETWORK_H
 #define THERMISTORMUX_NETWORK_H
 
+#include "thermistorMux_global.h"
+#include "thermistorMux_stats.h"
+
+// Published thermistor temperatures
+#ifdef MILLICELSIUS_PIPELINE
+typedef int32_t ThermistorValue;    // Milli-degrees C, THERMISTOR_NO_DATA if none
+#else
+typedef float ThermistorValue;      // Degrees C, NAN if none
+#endif
+
 // Public functions
 bool network_init();
 void check_brokers();
-void publish_data(float* thermistor_data, float ADC_temperature);
+void publish_data(const ThermistorValue* thermistor_data, float ADC_temperature, const ChannelStats* thermistor_stats);
 void publish_refs(float ref_Low, float ref_High);
+void publish_calibration_points(uint32_t points, uint32_t fit);
+void publish_calibration_progress(bool in_work, float progress, float noise);
+void publish_adc_settings(void);
+void publish_adc_calibration(void);
+void publish_filter_settings(void);
+void publish_channel_masks(void);
+void publish_switch_times(void);
 bool update_ntp();
 unsigned long get_current_time();
 unsigned long long get_current_time_millis();
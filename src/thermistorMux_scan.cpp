@@ -0,0 +1,949 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_scan.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Acquisition state machine.  Each call to scan_service() advances the
+ * scan by at most one step (switch MOSFET -> settle -> start scan cycle -> wait
+ * for the ADC data ready interrupt -> switch to the next channel while the
+ * result is read) and returns immediately, so the main loop can service the
+ * network between conversions.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_global.h"
+#include "thermistorMux_scan.h"
+#include "command_ADC.h"
+
+#define INTERRUPT_PIN 23
+
+// Minimum time to wait for the data ready interrupt before restarting a
+// conversion; slow conversion settings wait for twice the worst case time
+#define SCAN_CONVERSION_TIMEOUT_US 200000
+
+// Default time between turning one MOSFET off and the next one on
+#define SCAN_BREAK_BEFORE_MAKE_US 10
+
+// Default time allowed for a thermistor input to settle after its MOSFET is
+// turned on, before its scan cycle is started, for every channel group
+#define SCAN_SETTLE_US 0
+
+// Number of consecutive saturated results, or results with no temperature,
+// after which a channel is marked as faulted (open, shorted or unpopulated)
+// and skipped
+#define SCAN_FAULT_SAMPLES 3
+
+// Number of frames between passes that probe the faulted channels again, so
+// that a thermistor that is reconnected is picked up
+#define SCAN_FAULT_PROBE_FRAMES 12
+
+// Time between measurements of the ADC offset and gain, which are corrected
+// in the ADC, and the number of conversions of each input averaged
+#define SCAN_ADC_CAL_INTERVAL_MS 600000
+#define SCAN_ADC_CAL_CONVERSIONS 8
+
+// Number of frames between single conversions of the reference input, which
+// keep the gain correction tracking the ADC's gain drift between measurements,
+// and the number of them in the running average
+#define SCAN_ADC_REF_FRAMES 10
+#define SCAN_ADC_REF_AVERAGE 8
+
+/*
+Array representing 32 Mosfets
+mosfet[0] = header pin 0; mosfet Q1
+mosfet[1] = header pin 1; mosfet Q2
+...
+mosfet[31] = header pin 22; mosfet Q32
+*/
+static unsigned int mosfet[NUMBER_OF_THERMISTORS] = {0,1,2,3,4,5,6,7,8,9,24,25,26,27,28,29,30,31,
+                                  32,36,37,40,41,14,15,16,17,18,19,20,21,22};
+
+/*
+The ADC sequences its own inputs in SCAN mode; the firmware starts one scan cycle
+per thermistor, switching the MOSFETs in between. The cycle of the first channel
+of each pass also converts the ADC internal temperature. It is converted before
+the thermistor input, so it uses time the MOSFET needs to settle anyway.
+
+Only the channels in the pass mask are scanned: those enabled by the user and
+not faulted, except on probe passes, which scan all the enabled channels.
+*/
+
+enum ScanState {
+    SCAN_SELECT_INPUT,  // Set up the scan cycle for the first channel
+    SCAN_SWITCHING,     // Break-before-make and settling of the next channel
+    SCAN_CONVERTING,    // Waiting for the data ready interrupt
+    SCAN_READING,       // Waiting for the queued read of an intermediate result
+    SCAN_ADC_CALIBRATING, // Converting the ADC offset and reference inputs
+};
+
+enum ScanEvent {
+    SCAN_BUSY,          // Nothing completed on this step
+    SCAN_PASS_DONE,     // A pass through all the channels has completed
+};
+
+static volatile bool irqFlag = false;
+static ScanState state       = SCAN_SELECT_INPUT;
+static int scan_channel      = 0;
+static int read_channel      = 0;
+static int cycle_conversions = 0;       // Conversions left in the current scan cycle
+static int scan_pass         = 0;
+static uint32_t state_start_us = 0;
+
+// Channel switching in progress
+static bool read_pending     = false;   // The previous channel's result is being read
+static bool mosfet_made      = false;   // The next channel's MOSFET is on
+static bool start_queued     = false;   // The next scan cycle has been started
+static uint32_t break_us     = 0;       // When the previous MOSFET was turned off
+static uint32_t make_us      = 0;       // When the next MOSFET was turned on
+static bool read_ends_pass   = false;   // The channel being read is the last of its pass
+
+// ADC offset and gain measurement, between frames
+static bool adc_cal_requested = true;   // Measure before the next frame
+static uint32_t adc_cal_ms    = 0;      // When they were last measured
+static int adc_cal_conversion = 0;      // Conversions done; offset first, then reference
+static bool adc_ref_only      = false;  // Only the last reference conversion is being done
+static int64_t adc_cal_sum[2];          // Sum of the codes of each ADCCalibrationInput
+static double adc_ref_code    = 0;      // Running average reference code, 0 until measured
+static int frames_since_ref   = 0;
+
+// Channel masks; bit n is thermistor n
+static_assert(NUMBER_OF_THERMISTORS == 32, "Channel masks have one bit per thermistor");
+static uint32_t enable_mask  = SCAN_ALL_CHANNELS;  // Channels enabled by the user
+static uint32_t fault_mask   = 0;       // Channels found open or shorted
+static uint32_t pass_mask    = SCAN_ALL_CHANNELS;  // Channels in the pass in progress
+static uint32_t valid_mask   = 0;       // Channels with a valid result in the pass in progress
+static uint32_t pass_valid_mask = 0;    // Channels with a valid result in the last completed pass
+static uint8_t saturated_count[NUMBER_OF_THERMISTORS];
+static int frames_since_probe = 0;
+
+// Switching times
+static uint32_t break_before_make_us = SCAN_BREAK_BEFORE_MAKE_US;
+static uint32_t settle_us[SCAN_CHANNEL_GROUPS];
+
+// ADC conversion settings for each channel group
+static ADCConversionSettings group_settings[SCAN_CHANNEL_GROUPS];
+static uint32_t conversion_timeout_us = SCAN_CONVERSION_TIMEOUT_US;
+
+// Filter settings for each channel group, and each channel's filter
+static FilterSettings group_filters[SCAN_CHANNEL_GROUPS];
+static ChannelFilter thermistor_filters[NUMBER_OF_THERMISTORS];
+
+// ADC codes from the pass in progress, converted together when it ends, and
+// the samples they convert to
+static uint32_t pass_thermistor_code[NUMBER_OF_THERMISTORS];
+#ifdef MILLICELSIUS_PIPELINE
+static int32_t pass_thermistor_millicelsius[NUMBER_OF_THERMISTORS];
+#else
+static float pass_thermistor_temp[NUMBER_OF_THERMISTORS] = {0.00};
+#endif
+static float pass_adc_temp = 0;
+
+// Statistics for the frame in progress and for the last completed frame.  In
+// the milli-degree build the samples are only converted to degrees once the
+// frame is complete.
+#ifdef MILLICELSIUS_PIPELINE
+static ChannelStatsMillicelsius acc_thermistor_stats[NUMBER_OF_THERMISTORS];
+static int32_t frame_thermistor_millicelsius[NUMBER_OF_THERMISTORS];
+#else
+static ChannelStats acc_thermistor_stats[NUMBER_OF_THERMISTORS];
+#endif
+static ChannelStats acc_adc_stats;
+static ChannelStats frame_thermistor_stats[NUMBER_OF_THERMISTORS];
+static float frame_thermistor_temp[NUMBER_OF_THERMISTORS] = {0.00};
+static float frame_adc_temp = 0;
+
+// Calibration capture: statistics of each channel's raw temperature over a
+// number of passes, taken alongside the frames.
+static uint32_t capture_passes = 0;     // Passes still to capture, 0 when idle
+#ifdef MILLICELSIUS_PIPELINE
+static ChannelStatsMillicelsius capture_stats_millicelsius[NUMBER_OF_THERMISTORS];
+#endif
+static ChannelStats capture_stats[NUMBER_OF_THERMISTORS];
+
+
+/*
+Upon recieving an interrupt from ADC(indicating new data is available in ADC),
+IRQ flag is triggered.
+*/
+void IRQ() {
+    irqFlag = true;
+}
+
+/*
+First channel in a mask.  The mask must not be empty.
+*/
+static int first_channel(uint32_t mask) {
+    return __builtin_ctz(mask);
+}
+
+/*
+Channels to scan in the next pass.  If every enabled channel is faulted they
+are all probed, so there is always a channel to convert the internal
+temperature with.
+*/
+static uint32_t next_pass_mask() {
+    uint32_t mask = enable_mask & ~fault_mask;
+    if (mask == 0 || frames_since_probe >= SCAN_FAULT_PROBE_FRAMES) {
+        frames_since_probe = 0;
+        mask = enable_mask;
+    }
+    return mask;
+}
+
+/*
+Channel after the given one in the pass in progress.  After the last channel of
+the pass a new pass is started, and read_ends_pass is set.
+*/
+static int next_channel(int channel) {
+    uint32_t later = (channel + 1 < NUMBER_OF_THERMISTORS) ? (pass_mask & (~0UL << (channel + 1))) : 0;
+    read_ends_pass = (later == 0);
+    if (read_ends_pass) {
+        pass_mask = next_pass_mask();
+        return first_channel(pass_mask);
+    }
+    return first_channel(later);
+}
+
+/*
+Scan cycle used for a channel in the pass in progress.
+*/
+static ADCScanCycle scan_cycle(int channel) {
+    return (channel == first_channel(pass_mask)) ? ADC_SCAN_THERMISTOR_AND_INTERNAL_TEMP : ADC_SCAN_THERMISTOR;
+}
+
+
+/*
+Channel group a channel belongs to.
+*/
+static int scan_group(int channel) {
+    return channel / (NUMBER_OF_THERMISTORS / SCAN_CHANNEL_GROUPS);
+}
+
+/*
+Conversion settings for a channel's scan cycle.  The driver only writes them to
+the ADC when they differ from the settings it already has.
+*/
+static const ADCConversionSettings* settings_for(int channel) {
+    const ADCConversionSettings* settings = &group_settings[scan_group(channel)];
+    conversion_timeout_us = 4 * ADC_max_conversion_time_us(settings);   //Twice the longest cycle
+    if (conversion_timeout_us < SCAN_CONVERSION_TIMEOUT_US) {
+        conversion_timeout_us = SCAN_CONVERSION_TIMEOUT_US;
+    }
+    return settings;
+}
+
+/*
+Clear any stale interrupt and start the scan cycle on the current channel.
+*/
+static void begin_conversion() {
+    irqFlag = false;
+    cycle_conversions = mcp3561.scan_conversions();
+    mcp3561.start_conversion();
+    state = SCAN_CONVERTING;
+    state_start_us = micros();
+}
+
+/*
+Turn the MOSFET for the current channel on.
+*/
+static void make_channel() {
+    digitalWrite(mosfet[scan_channel], HIGH);
+    make_us = micros();
+    mosfet_made = true;
+}
+
+/*
+Switch the MOSFETs from the current channel to the next one, and queue the read
+of the current channel's result. The thermistor result is latched in ADCDATA,
+so the next channel is switched in and settles while the result is clocked
+out. When no break-before-make or settling time is needed, the scan setup and
+START for the next channel are queued in the same chain as the read.
+*/
+static void advance_channel(bool read_data) {
+    digitalWrite(mosfet[scan_channel], LOW);
+    break_us = micros();
+    mosfet_made = false;
+
+    read_channel = scan_channel;
+    scan_channel = next_channel(scan_channel);
+
+    if (break_before_make_us == 0) {
+        make_channel();
+    }
+    start_queued = mosfet_made && (settle_us[scan_group(scan_channel)] == 0);
+    if (start_queued) {
+        irqFlag = false;
+    }
+    read_pending = read_data;
+    mcp3561.queue_transfer(read_data, settings_for(scan_channel), scan_cycle(scan_channel), start_queued);
+    cycle_conversions = mcp3561.scan_conversions();
+    state = SCAN_SWITCHING;
+}
+
+/*
+Count a thermistor result that saturated or has no temperature.  A thermistor
+that fails SCAN_FAULT_SAMPLES times in a row is marked as faulted.
+*/
+static void result_failed(int channel) {
+    uint32_t bit = 1UL << channel;
+    if (saturated_count[channel] < SCAN_FAULT_SAMPLES) {
+        saturated_count[channel]++;
+    }
+    if (saturated_count[channel] >= SCAN_FAULT_SAMPLES && !(fault_mask & bit)) {
+        fault_mask |= bit;
+        DebugPrintNoEOL("Thermistor fault, skipping channel ");
+        DebugPrint(channel + 1);
+    }
+}
+
+/*
+Store a result read from the ADC in the pass in progress.  Saturated
+thermistor results count towards a fault.
+Returns the channel ID the result was tagged with.
+*/
+static uint8_t collect_result() {
+    uint8_t channel_id;
+    uint32_t code;
+    bool valid = mcp3561.read_queued_code(&channel_id, &code);
+
+    if (channel_id == ADC_CHID_TEMP) {
+        if (valid) {
+            pass_adc_temp = convert_internal_temp(code);
+        }
+    }
+    else if (channel_id == ADC_CHID_DIFF_A) {
+        if (!valid) {
+            result_failed(read_channel);
+        }
+        else {
+            valid_mask |= 1UL << read_channel;
+            pass_thermistor_code[read_channel] = code;
+        }
+    }
+    return channel_id;
+}
+
+/*
+Finish a pass: convert the codes of the pass just read in one batch.  A code
+that converts to no temperature (a shorted input gives a code of 0 or below)
+counts towards a fault like a saturated one, and a channel that gives a
+temperature is cleared, restarting its filter so its output isn't built from
+samples taken before the fault.  The channels with temperatures are those of
+that pass.
+*/
+static ScanEvent end_pass() {
+#ifdef MILLICELSIUS_PIPELINE
+    convert_thermistor_batch_millicelsius(pass_thermistor_code, valid_mask, pass_thermistor_millicelsius);
+#else
+    convert_thermistor_batch(pass_thermistor_code, valid_mask, pass_thermistor_temp);
+#endif
+    for (uint32_t converted = valid_mask; converted; converted &= converted - 1) {
+        int channel = __builtin_ctz(converted);
+        uint32_t bit = 1UL << channel;
+#ifdef MILLICELSIUS_PIPELINE
+        bool has_temp = (pass_thermistor_millicelsius[channel] != THERMISTOR_NO_DATA);
+#else
+        bool has_temp = !isnan(pass_thermistor_temp[channel]);
+#endif
+        if (has_temp) {
+            saturated_count[channel] = 0;
+            if (fault_mask & bit) {
+                fault_mask &= ~bit;
+                filter_reset(&thermistor_filters[channel]);
+            }
+        }
+        else {
+            valid_mask &= ~bit;
+            result_failed(channel);
+        }
+    }
+    pass_valid_mask = valid_mask;
+    valid_mask = 0;
+    return SCAN_PASS_DONE;
+}
+
+/*
+Input converted by a conversion of the ADC offset and gain measurement.
+*/
+static ADCCalibrationInput adc_cal_input(int conversion) {
+    return (conversion < SCAN_ADC_CAL_CONVERSIONS) ? ADC_CAL_OFFSET : ADC_CAL_REFERENCE;
+}
+
+/*
+Start measuring the ADC offset and gain, from the given conversion: 0 for the
+full measurement, or the last conversion for a single conversion of the
+reference input.  The MOSFETs are all off and any scan cycle in progress is
+abandoned; the acquisition carries on with the same channel once the
+measurement is done.
+*/
+static void begin_adc_calibration(int first_conversion) {
+    while (mcp3561.transfer_busy()) {
+    }
+    digitalWrite(mosfet[scan_channel], LOW);
+    adc_cal_conversion = first_conversion;
+    adc_ref_only = (first_conversion > 0);
+    adc_cal_sum[ADC_CAL_OFFSET] = 0;
+    adc_cal_sum[ADC_CAL_REFERENCE] = 0;
+    frames_since_ref = 0;
+    irqFlag = false;
+    mcp3561.start_calibration_conversion(adc_cal_input(first_conversion));
+    state = SCAN_ADC_CALIBRATING;
+    state_start_us = micros();
+}
+
+/*
+Go back to scanning without changing the ADC calibration.  An abandoned full
+measurement waits for the next interval; a single reference conversion is just
+tried again after a few frames.
+*/
+static void abandon_adc_calibration() {
+    mcp3561.end_calibration();
+    if (!adc_ref_only) {
+        adc_cal_ms = millis();
+    }
+    state = SCAN_SELECT_INPUT;
+}
+
+/*
+Collect one conversion of the ADC offset and gain measurement and start the
+next, or program the ADC once they are all done.  A single reference
+conversion only updates the gain, from the running average of the reference
+and the offset already programmed.
+*/
+static void adc_calibration_step() {
+    if (!irqFlag) {
+        if (micros() - state_start_us >= conversion_timeout_us) {
+            DebugPrint("ADC calibration conversion timed out, calibration abandoned");
+            abandon_adc_calibration();
+        }
+        return;
+    }
+    int32_t code;
+    if (!mcp3561.read_calibration_code(&code)) {
+        DebugPrint("ADC calibration input out of range, calibration abandoned");
+        abandon_adc_calibration();
+        return;
+    }
+    adc_cal_sum[adc_cal_input(adc_cal_conversion)] += code;
+    if (++adc_cal_conversion < 2 * SCAN_ADC_CAL_CONVERSIONS) {
+        irqFlag = false;
+        mcp3561.start_calibration_conversion(adc_cal_input(adc_cal_conversion));
+        state_start_us = micros();
+        return;
+    }
+    if (adc_ref_only) {
+        adc_ref_code += (code - adc_ref_code) / SCAN_ADC_REF_AVERAGE;
+        if (!mcp3561.set_calibration(-mcp3561.offset_calibration(), lround(adc_ref_code))) {
+            DebugPrint("ADC gain out of range, calibration not changed");
+        }
+        state = SCAN_SELECT_INPUT;
+        return;
+    }
+    adc_ref_code = double(adc_cal_sum[ADC_CAL_REFERENCE]) / SCAN_ADC_CAL_CONVERSIONS;
+    if (!mcp3561.set_calibration(adc_cal_sum[ADC_CAL_OFFSET] / SCAN_ADC_CAL_CONVERSIONS,
+                                 adc_cal_sum[ADC_CAL_REFERENCE] / SCAN_ADC_CAL_CONVERSIONS)) {
+        DebugPrint("ADC offset or gain out of range, calibration not changed");
+    }
+    adc_cal_ms = millis();
+    state = SCAN_SELECT_INPUT;
+}
+
+/*
+Advance the state machine by one step.  Never waits; returns SCAN_PASS_DONE
+when the last channel of a pass has been read.
+*/
+static ScanEvent scan_step() {
+    ScanEvent event = SCAN_BUSY;
+
+    switch (state) {
+    case SCAN_SELECT_INPUT:
+        if (adc_cal_requested) {
+            adc_cal_requested = false;
+            begin_adc_calibration(0);
+            break;
+        }
+        //Program the settings and scan cycle for the first channel, then switch it in.
+        mcp3561.queue_transfer(false, settings_for(scan_channel), scan_cycle(scan_channel), false);
+        read_pending = false;
+        mosfet_made = false;
+        start_queued = false;
+        break_us = micros();
+        state = SCAN_SWITCHING;
+        break;
+
+    case SCAN_SWITCHING:
+        if (!mosfet_made) {
+            if (micros() - break_us < break_before_make_us) {
+                break;
+            }
+            make_channel();
+        }
+        if (mcp3561.transfer_busy()) {
+            break;
+        }
+        if (read_pending) {
+            read_pending = false;
+            if ((collect_result() == ADC_CHID_DIFF_A) && read_ends_pass) {
+                event = end_pass();
+            }
+        }
+        if (!start_queued) {
+            if (micros() - make_us < settle_us[scan_group(scan_channel)]) {
+                break;
+            }
+            irqFlag = false;
+            cycle_conversions = mcp3561.scan_conversions();
+            mcp3561.queue_transfer(false, NULL, ADC_SCAN_UNCHANGED, true);
+        }
+        state = SCAN_CONVERTING;
+        state_start_us = micros();
+        break;
+
+    case SCAN_CONVERTING:
+        if (!irqFlag || mcp3561.transfer_busy()) {
+            if (micros() - state_start_us >= conversion_timeout_us) {
+                //No data ready interrupt; the conversion was lost, start the cycle again.
+                DebugPrint("ADC conversion timed out, restarting conversion");
+                begin_conversion();
+            }
+            break;
+        }
+
+        if (--cycle_conversions <= 0) {
+            //The thermistor input is the last conversion of every cycle.
+            advance_channel(true);
+        }
+        else {
+            //The internal temperature comes first; the thermistor is still converting.
+            irqFlag = false;
+            mcp3561.queue_transfer(true, NULL, ADC_SCAN_UNCHANGED, false);
+            read_channel = scan_channel;
+            state = SCAN_READING;
+        }
+        break;
+
+    case SCAN_READING:
+        if (mcp3561.transfer_busy()) {
+            break;
+        }
+        state = SCAN_CONVERTING;
+        if (collect_result() == ADC_CHID_DIFF_A) {
+            //The thermistor result overwrote the internal temperature before it was
+            //read; the cycle is complete so move on, keeping the last internal temperature.
+            advance_channel(false);
+            if (read_ends_pass) {
+                event = end_pass();
+            }
+        }
+        break;
+
+    case SCAN_ADC_CALIBRATING:
+        adc_calibration_step();
+        break;
+    }
+    return event;
+}
+
+/**
+ * @brief Set up the MOSFET control pins and the ADC data ready interrupt.
+ */
+void scan_init() {
+    //MOSFET digital control I/O ports, set to output. All MOSFETS turned off (pins set to LOW).
+    for (int mosfetRef = 0; mosfetRef < NUMBER_OF_THERMISTORS; mosfetRef++) {
+        pinMode(mosfet[mosfetRef], OUTPUT);
+        digitalWrite(mosfet[mosfetRef], LOW);
+    }
+
+    for (int group = 0; group < SCAN_CHANNEL_GROUPS; group++) {
+        settle_us[group] = SCAN_SETTLE_US;
+        group_settings[group].osr = ADC_DEFAULT_OSR;
+        group_settings[group].prescaler = ADC_DEFAULT_PRESCALER;
+        group_settings[group].auto_zero = ADC_DEFAULT_AUTO_ZERO;
+        group_filters[group].mode = FILTER_DEFAULT_MODE;
+        group_filters[group].length = FILTER_DEFAULT_LENGTH;
+        group_filters[group].alpha = FILTER_DEFAULT_ALPHA;
+    }
+    filter_init();
+
+    /*
+    Enable global interrupts.
+    Set up ADC interrupt feature on teensy pin 23.
+    */
+    pinMode(INTERRUPT_PIN, INPUT_PULLUP);
+    attachInterrupt(digitalPinToInterrupt(INTERRUPT_PIN), IRQ, FALLING);
+    sei();
+
+    scan_restart();
+}
+
+/**
+ * @brief Abandon the frame in progress and start again from the first
+ * thermistor.
+ */
+void scan_restart() {
+    while (mcp3561.transfer_busy()) {
+    }
+    digitalWrite(mosfet[scan_channel], LOW);
+    pass_mask = next_pass_mask();
+    scan_channel = first_channel(pass_mask);
+    valid_mask = 0;
+    scan_pass = 0;
+    for (int mosfetRef = 0; mosfetRef < NUMBER_OF_THERMISTORS; mosfetRef++) {
+        filter_reset(&thermistor_filters[mosfetRef]);
+    }
+    state = SCAN_SELECT_INPUT;
+}
+
+/**
+ * @brief Set the time between turning one MOSFET off and turning the next one
+ * on.  Takes effect from the next channel switch.
+ *
+ * @param us break-before-make time in microseconds, up to SCAN_MAX_SWITCH_US
+ * @return true on success
+ * @return false if the time is too long
+ */
+bool scan_set_break_before_make(uint32_t us) {
+    if (us > SCAN_MAX_SWITCH_US) {
+        return false;
+    }
+    break_before_make_us = us;
+    return true;
+}
+
+/**
+ * @brief The time between turning one MOSFET off and turning the next one on,
+ * in microseconds.
+ */
+uint32_t scan_break_before_make() {
+    return break_before_make_us;
+}
+
+/**
+ * @brief Set the time the thermistor inputs of a group of channels are
+ * allowed to settle after their MOSFET is turned on, before their conversion
+ * is started.  Takes effect from the next channel switch.
+ *
+ * @param group channel group, 0 to SCAN_CHANNEL_GROUPS - 1
+ * @param us settling time in microseconds, up to SCAN_MAX_SWITCH_US
+ * @return true on success
+ * @return false if the group or time is invalid
+ */
+bool scan_set_group_settle_time(int group, uint32_t us) {
+    if (group < 0 || group >= SCAN_CHANNEL_GROUPS || us > SCAN_MAX_SWITCH_US) {
+        return false;
+    }
+    settle_us[group] = us;
+    return true;
+}
+
+/**
+ * @brief The settling time of a group of channels, in microseconds.
+ *
+ * @param group channel group, 0 to SCAN_CHANNEL_GROUPS - 1
+ */
+uint32_t scan_group_settle_time(int group) {
+    return settle_us[group];
+}
+
+/**
+ * @brief Set which thermistors are scanned.  Channels that are disabled are
+ * skipped entirely, and publish NAN.  Takes effect from the next pass, and
+ * the filters of the channels enabled again restart.
+ *
+ * @param mask bit n enables thermistor n; at least one must be enabled
+ * @return true on success
+ * @return false if no channels are enabled
+ */
+bool scan_set_enable_mask(uint32_t mask) {
+    mask &= SCAN_ALL_CHANNELS;
+    if (mask == 0) {
+        return false;
+    }
+    for (uint32_t added = mask & ~enable_mask; added; added &= added - 1) {
+        filter_reset(&thermistor_filters[__builtin_ctz(added)]);
+    }
+    enable_mask = mask;
+    fault_mask &= mask;
+    return true;
+}
+
+/**
+ * @brief The thermistors that are enabled, bit n for thermistor n.
+ */
+uint32_t scan_enable_mask() {
+    return enable_mask;
+}
+
+/**
+ * @brief The enabled thermistors that saturated or gave no temperature
+ * SCAN_FAULT_SAMPLES times in a row, bit n for thermistor n.  These are skipped, except for a probe pass
+ * every SCAN_FAULT_PROBE_FRAMES frames, until they give a valid result again.
+ */
+uint32_t scan_fault_mask() {
+    return fault_mask;
+}
+
+/**
+ * @brief Set the ADC conversion settings for a group of channels.  They are
+ * written to the ADC before the next scan cycle is started.
+ *
+ * @param group channel group, 0 to SCAN_CHANNEL_GROUPS - 1
+ * @param settings the new settings
+ * @return true on success
+ * @return false if the group or settings are invalid
+ */
+bool scan_set_group_settings(int group, const ADCConversionSettings* settings) {
+    if (group < 0 || group >= SCAN_CHANNEL_GROUPS || !ADC_valid_settings(settings)) {
+        return false;
+    }
+    group_settings[group] = *settings;
+    return true;
+}
+
+/**
+ * @brief The ADC conversion settings for a group of channels.
+ *
+ * @param group channel group, 0 to SCAN_CHANNEL_GROUPS - 1
+ */
+const ADCConversionSettings* scan_group_settings(int group) {
+    return &group_settings[group];
+}
+
+/**
+ * @brief Set the filter for a group of channels.  The filters of the group's
+ * channels start again from their next samples.
+ *
+ * @param group channel group, 0 to SCAN_CHANNEL_GROUPS - 1
+ * @param settings the new settings
+ * @return true on success
+ * @return false if the group or settings are invalid
+ */
+bool scan_set_group_filter(int group, const FilterSettings* settings) {
+    if (group < 0 || group >= SCAN_CHANNEL_GROUPS || !filter_valid_settings(settings)) {
+        return false;
+    }
+    group_filters[group] = *settings;
+    for (int mosfetRef = 0; mosfetRef < NUMBER_OF_THERMISTORS; mosfetRef++) {
+        if (scan_group(mosfetRef) == group) {
+            filter_reset(&thermistor_filters[mosfetRef]);
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief The filter settings for a group of channels.
+ *
+ * @param group channel group, 0 to SCAN_CHANNEL_GROUPS - 1
+ */
+const FilterSettings* scan_group_filter(int group) {
+    return &group_filters[group];
+}
+
+/**
+ * @brief Advance the acquisition by at most one step without waiting.  This
+ * should be called from every pass through loop().
+ *
+ * Every pass is fed through each channel's filter.  A frame's thermistor
+ * temperatures are the filter outputs after its last pass, or the means of its
+ * passes for channels with no filter; the statistics are always of the
+ * unfiltered samples.  Channels with no valid samples in the frame, because
+ * they are disabled or faulted, are NAN.  In the milli-degree build the
+ * samples, filters and statistics are all integers until the frame is
+ * complete.
+ *
+ * @return true when a new frame of statistics over SCAN_PASSES_PER_FRAME passes is
+ * available from scan_thermistor_frame(), scan_thermistor_stats() and
+ * scan_adc_temperature()
+ * @return false otherwise
+ */
+bool scan_service() {
+    if (scan_step() != SCAN_PASS_DONE) {
+        return false;
+    }
+
+    if (scan_pass == 0) {
+        for (int mosfetRef = 0; mosfetRef < NUMBER_OF_THERMISTORS; mosfetRef++) {
+#ifdef MILLICELSIUS_PIPELINE
+            stats_reset_millicelsius(&acc_thermistor_stats[mosfetRef]);
+#else
+            stats_reset(&acc_thermistor_stats[mosfetRef]);
+#endif
+        }
+        stats_reset(&acc_adc_stats);
+    }
+    for (int mosfetRef = 0; mosfetRef < NUMBER_OF_THERMISTORS; mosfetRef++) {
+        if (!(pass_valid_mask & (1UL << mosfetRef))) {
+            continue;
+        }
+#ifdef MILLICELSIUS_PIPELINE
+        int32_t sample = pass_thermistor_millicelsius[mosfetRef];
+        stats_add_millicelsius(&acc_thermistor_stats[mosfetRef], sample);
+        if (capture_passes) {
+            stats_add_millicelsius(&capture_stats_millicelsius[mosfetRef], sample);
+        }
+#else
+        float sample = pass_thermistor_temp[mosfetRef];
+        stats_add(&acc_thermistor_stats[mosfetRef], sample);
+        if (capture_passes) {
+            stats_add(&capture_stats[mosfetRef], sample);
+        }
+#endif
+        filter_add(&thermistor_filters[mosfetRef], &group_filters[scan_group(mosfetRef)], sample);
+    }
+    stats_add(&acc_adc_stats, pass_adc_temp);
+    if (capture_passes) {
+        capture_passes--;
+    }
+
+    if (++scan_pass < SCAN_PASSES_PER_FRAME) {
+        return false;
+    }
+    scan_pass = 0;
+    frames_since_probe++;
+#ifdef MILLICELSIUS_PIPELINE
+    for (int mosfetRef = 0; mosfetRef < NUMBER_OF_THERMISTORS; mosfetRef++) {
+        stats_to_degrees(&acc_thermistor_stats[mosfetRef], &frame_thermistor_stats[mosfetRef]);
+        if (acc_thermistor_stats[mosfetRef].count == 0) {
+            frame_thermistor_millicelsius[mosfetRef] = THERMISTOR_NO_DATA;
+        }
+        else if (group_filters[scan_group(mosfetRef)].mode == FILTER_NONE) {
+            frame_thermistor_millicelsius[mosfetRef] = stats_mean_millicelsius(&acc_thermistor_stats[mosfetRef]);
+        }
+        else {
+            frame_thermistor_millicelsius[mosfetRef] = thermistor_filters[mosfetRef].output;
+        }
+        int32_t millicelsius = frame_thermistor_millicelsius[mosfetRef];
+        frame_thermistor_temp[mosfetRef] = (millicelsius == THERMISTOR_NO_DATA) ? NAN : millicelsius * 0.001f;
+    }
+#else
+    memcpy(frame_thermistor_stats, acc_thermistor_stats, sizeof(frame_thermistor_stats));
+    for (int mosfetRef = 0; mosfetRef < NUMBER_OF_THERMISTORS; mosfetRef++) {
+        if (frame_thermistor_stats[mosfetRef].count == 0) {
+            frame_thermistor_temp[mosfetRef] = NAN;
+        }
+        else if (group_filters[scan_group(mosfetRef)].mode == FILTER_NONE) {
+            frame_thermistor_temp[mosfetRef] = frame_thermistor_stats[mosfetRef].mean;
+        }
+        else {
+            frame_thermistor_temp[mosfetRef] = thermistor_filters[mosfetRef].output;
+        }
+    }
+#endif
+    frame_adc_temp = acc_adc_stats.mean;
+
+    //The ADC offset and gain are measured between frames, so no frame mixes
+    //results from before and after they change.  In between, one conversion of
+    //the reference every few frames keeps the gain correction following the
+    //ADC's gain drift.
+    if (adc_cal_requested || millis() - adc_cal_ms >= SCAN_ADC_CAL_INTERVAL_MS) {
+        adc_cal_requested = false;
+        begin_adc_calibration(0);
+    }
+    else if (++frames_since_ref >= SCAN_ADC_REF_FRAMES && adc_ref_code > 0) {
+        begin_adc_calibration(2 * SCAN_ADC_CAL_CONVERSIONS - 1);
+    }
+    return true;
+}
+
+/**
+ * @brief Start capturing the raw temperature of each channel over a number of
+ * passes for calibration.  The capture is taken by scan_service() alongside
+ * the frames, so it doesn't hold up anything else.  Any capture in progress is
+ * restarted.
+ *
+ * @param passes number of passes to capture; 0 cancels the capture
+ */
+void scan_start_capture(uint32_t passes) {
+    for (int mosfetRef = 0; mosfetRef < NUMBER_OF_THERMISTORS; mosfetRef++) {
+#ifdef MILLICELSIUS_PIPELINE
+        stats_reset_millicelsius(&capture_stats_millicelsius[mosfetRef]);
+#endif
+        stats_reset(&capture_stats[mosfetRef]);
+    }
+    capture_passes = passes;
+}
+
+/**
+ * @brief The number of passes still to be captured, 0 once the capture is
+ * complete.
+ */
+uint32_t scan_capture_remaining() {
+    return capture_passes;
+}
+
+/**
+ * @brief The statistics of the raw thermistor temperatures captured so far.
+ * Channels that were skipped or saturated on every pass have a count of 0.
+ *
+ * @return array of NUMBER_OF_THERMISTORS statistics
+ */
+const ChannelStats* scan_capture_stats() {
+#ifdef MILLICELSIUS_PIPELINE
+    for (int mosfetRef = 0; mosfetRef < NUMBER_OF_THERMISTORS; mosfetRef++) {
+        stats_to_degrees(&capture_stats_millicelsius[mosfetRef], &capture_stats[mosfetRef]);
+    }
+#endif
+    return capture_stats;
+}
+
+/**
+ * @brief Measure the ADC offset and gain again after the frame in progress,
+ * rather than waiting for the next periodic measurement.
+ */
+void scan_request_adc_calibration() {
+    adc_cal_requested = true;
+}
+
+/**
+ * @brief The thermistor temperatures from the last completed frame.
+ *
+ * @return array of NUMBER_OF_THERMISTORS floats
+ */
+const float* scan_thermistor_frame() {
+    return frame_thermistor_temp;
+}
+
+#ifdef MILLICELSIUS_PIPELINE
+/**
+ * @brief The thermistor temperatures from the last completed frame in
+ * milli-degrees C.
+ *
+ * @return array of NUMBER_OF_THERMISTORS temperatures, THERMISTOR_NO_DATA for
+ * channels with no valid samples
+ */
+const int32_t* scan_thermistor_frame_millicelsius() {
+    return frame_thermistor_millicelsius;
+}
+#endif
+
+/**
+ * @brief The statistics of the thermistor temperatures over the last completed
+ * frame.
+ *
+ * @return array of NUMBER_OF_THERMISTORS statistics
+ */
+const ChannelStats* scan_thermistor_stats() {
+    return frame_thermistor_stats;
+}
+
+/**
+ * @brief The ADC internal temperature from the last completed frame.
+ */
+float scan_adc_temperature() {
+    return frame_adc_temp;
+}
@@ -0,0 +1,72 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_scan.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Function prototypes for the acquisition state machine, which cycles
+ * through the thermistor MOSFETs and ADC conversions without blocking.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_SCAN_H
+#define THERMISTORMUX_SCAN_H
+
+#include "thermistorMux_global.h"
+#include "command_ADC.h"
+#include "thermistorMux_stats.h"
+#include "thermistorMux_filter.h"
+
+// Number of passes through all the thermistors averaged into one frame
+#define SCAN_PASSES_PER_FRAME 5
+
+// Number of groups of consecutive thermistors with their own ADC conversion
+// settings.  NUMBER_OF_THERMISTORS must be a multiple of this.
+#define SCAN_CHANNEL_GROUPS 4
+
+// Longest break-before-make or settling time, in microseconds
+#define SCAN_MAX_SWITCH_US 100000
+
+// Channel mask with every thermistor, bit n for thermistor n
+#define SCAN_ALL_CHANNELS 0xFFFFFFFFUL
+
+void scan_init();
+void scan_restart();
+bool scan_service();
+void scan_start_capture(uint32_t passes);
+uint32_t scan_capture_remaining();
+const ChannelStats* scan_capture_stats();
+void scan_request_adc_calibration();
+const float* scan_thermistor_frame();
+#ifdef MILLICELSIUS_PIPELINE
+const int32_t* scan_thermistor_frame_millicelsius();
+#endif
+const ChannelStats* scan_thermistor_stats();
+float scan_adc_temperature();
+bool scan_set_break_before_make(uint32_t us);
+uint32_t scan_break_before_make();
+bool scan_set_group_settle_time(int group, uint32_t us);
+uint32_t scan_group_settle_time(int group);
+bool scan_set_enable_mask(uint32_t mask);
+uint32_t scan_enable_mask();
+uint32_t scan_fault_mask();
+bool scan_set_group_settings(int group, const ADCConversionSettings* settings);
+const ADCConversionSettings* scan_group_settings(int group);
+bool scan_set_group_filter(int group, const FilterSettings* settings);
+const FilterSettings* scan_group_filter(int group);
+
+
+#endif
@@ -0,0 +1,159 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_stats.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Streaming statistics using Welford's algorithm.  Each sample updates
+ * the mean and the sum of squared differences from the mean directly, which
+ * avoids the cancellation error of summing squares, and needs only an add, a
+ * multiply and a divide per sample, so it carries over to fixed-point samples.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_global.h"
+#include "thermistorMux_stats.h"
+
+/**
+ * @brief Discard all samples.
+ */
+void stats_reset(ChannelStats *stats) {
+    stats->count = 0;
+    stats->mean = 0;
+    stats->m2 = 0;
+    stats->min = 0;
+    stats->max = 0;
+}
+
+/**
+ * @brief Add a sample to the statistics.
+ */
+void stats_add(ChannelStats *stats, float sample) {
+    stats->count++;
+    if (stats->count == 1) {
+        stats->mean = sample;
+        stats->m2 = 0;
+        stats->min = sample;
+        stats->max = sample;
+        return;
+    }
+
+    float delta = sample - stats->mean;
+    stats->mean += delta / stats->count;
+    stats->m2 += delta * (sample - stats->mean);
+
+    if (sample < stats->min) {
+        stats->min = sample;
+    }
+    if (sample > stats->max) {
+        stats->max = sample;
+    }
+}
+
+/**
+ * @brief Convert the statistics to those of (gain * sample + offset), for
+ * example to apply a linear calibration after the samples have been collected.
+ */
+void stats_scale(ChannelStats *stats, float gain, float offset) {
+    stats->mean = gain * stats->mean + offset;
+    stats->m2 = gain * gain * stats->m2;
+
+    float min = gain * stats->min + offset;
+    float max = gain * stats->max + offset;
+    stats->min = (gain < 0) ? max : min;
+    stats->max = (gain < 0) ? min : max;
+}
+
+/**
+ * @brief The sample variance, or 0 if there are fewer than two samples.
+ */
+float stats_variance(const ChannelStats *stats) {
+    if (stats->count < 2) {
+        return 0;
+    }
+    return stats->m2 / (stats->count - 1);
+}
+
+/**
+ * @brief The sample standard deviation, or 0 if there are fewer than two
+ * samples.
+ */
+float stats_std_dev(const ChannelStats *stats) {
+    return sqrtf(stats_variance(stats));
+}
+
+#ifdef MILLICELSIUS_PIPELINE
+/**
+ * @brief Discard all milli-degree samples.
+ */
+void stats_reset_millicelsius(ChannelStatsMillicelsius *stats) {
+    stats->count = 0;
+    stats->first = 0;
+    stats->sum = 0;
+    stats->sum_sq = 0;
+    stats->min = 0;
+    stats->max = 0;
+}
+
+/**
+ * @brief Add a milli-degree sample to the statistics, without floating point.
+ */
+void stats_add_millicelsius(ChannelStatsMillicelsius *stats, int32_t sample) {
+    if (stats->count++ == 0) {
+        stats->first = sample;
+        stats->min = sample;
+        stats->max = sample;
+        return;
+    }
+
+    int64_t delta = int64_t(sample) - stats->first;
+    stats->sum += delta;
+    stats->sum_sq += delta * delta;
+
+    if (sample < stats->min) {
+        stats->min = sample;
+    }
+    if (sample > stats->max) {
+        stats->max = sample;
+    }
+}
+
+/**
+ * @brief The mean of the milli-degree samples, rounded to the nearest
+ * milli-degree.  There must be at least one sample.
+ */
+int32_t stats_mean_millicelsius(const ChannelStatsMillicelsius *stats) {
+    int64_t half = (stats->sum < 0) ? -int64_t(stats->count / 2) : int64_t(stats->count / 2);
+    return stats->first + int32_t((stats->sum + half) / int64_t(stats->count));
+}
+
+/**
+ * @brief Convert milli-degree statistics to degrees, e.g. once a frame is
+ * complete.
+ */
+void stats_to_degrees(const ChannelStatsMillicelsius *stats, ChannelStats *degrees) {
+    degrees->count = stats->count;
+    if (stats->count == 0) {
+        stats_reset(degrees);
+        return;
+    }
+    double mean = double(stats->sum) / stats->count;
+    degrees->mean = (stats->first + mean) * 0.001;
+    degrees->m2 = (stats->sum_sq - stats->sum * mean) * 0.000001;
+    degrees->min = stats->min * 0.001f;
+    degrees->max = stats->max * 0.001f;
+}
+#endif
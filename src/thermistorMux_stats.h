@@ -0,0 +1,65 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_stats.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Streaming statistics (mean, variance, min, max, count) for a channel,
+ * updated one sample at a time without storing the samples.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_STATS_H
+#define THERMISTORMUX_STATS_H
+
+#include "thermistorMux_global.h"
+
+// Running statistics for one channel
+typedef struct {
+    uint32_t count;     // Number of samples
+    float    mean;      // Mean of the samples
+    float    m2;        // Sum of the squared differences from the mean
+    float    min;       // Smallest sample
+    float    max;       // Largest sample
+} ChannelStats;
+
+#ifdef MILLICELSIUS_PIPELINE
+// Running statistics for one channel of milli-degree samples, in integers.
+// The sums are of the differences from the first sample, so they stay small.
+typedef struct {
+    uint32_t count;     // Number of samples
+    int32_t  first;     // First sample
+    int64_t  sum;       // Sum of (sample - first)
+    int64_t  sum_sq;    // Sum of (sample - first)^2
+    int32_t  min;       // Smallest sample
+    int32_t  max;       // Largest sample
+} ChannelStatsMillicelsius;
+#endif
+
+void stats_reset(ChannelStats *stats);
+void stats_add(ChannelStats *stats, float sample);
+void stats_scale(ChannelStats *stats, float gain, float offset);
+float stats_variance(const ChannelStats *stats);
+float stats_std_dev(const ChannelStats *stats);
+#ifdef MILLICELSIUS_PIPELINE
+void stats_reset_millicelsius(ChannelStatsMillicelsius *stats);
+void stats_add_millicelsius(ChannelStatsMillicelsius *stats, int32_t sample);
+int32_t stats_mean_millicelsius(const ChannelStatsMillicelsius *stats);
+void stats_to_degrees(const ChannelStatsMillicelsius *stats, ChannelStats *degrees);
+#endif
+
+
+#endif
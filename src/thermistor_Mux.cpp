@@ -28,6 +28,8 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #include "thermistorMux_hardware.h"
 #include "thermistorMux_global.h"
 #include "thermistor_Mux.h"
+#include "thermistorMux_scan.h"
+#include "thermistorMux_calibration.h"
 
 /*
 Questions:
@@ -36,238 +38,601 @@ Questions:
 3) 
 */
 
-   
-#define CS 10
-#define INTERRUPT_PIN 23
-
-/*
-Array representing 32 Mosfets
-mosfet[0] = header pin 0; mosfet Q1
-mosfet[1] = header pin 1; mosfet Q2
-...
-mosfet[31] = header pin 22; mosfet Q32
-*/
-static unsigned int mosfet[NUMBER_OF_THERMISTORS] = {0,1,2,3,4,5,6,7,8,9,24,25,26,27,28,29,30,31,
-                                  32,36,37,40,41,14,15,16,17,18,19,20,21,22};                                 
-static int irqFlag = 0;
 unsigned int eeAddr;
 bool setup_successful = false;
 int mosfetRef;
 bool calibrated = false;
-static float ref_Low = {0.00};
-static float ref_High = {0.00};
-static float raw_Low[NUMBER_OF_THERMISTORS] = {0.00};
-static float raw_High[NUMBER_OF_THERMISTORS] = {0.00};
 
+/*
+Calibration points: up to CAL_MAX_POINTS reference temperatures captured one at
+a time, then fitted for every channel. The two-point calibration is the first
+two points fitted piecewise. Once fitted, the first point captured after that
+starts a new set.
+*/
+typedef struct {
+  uint32_t points;
+  uint32_t fit;                                       // CalibrationFit
+  float    ref[CAL_MAX_POINTS];                       // Degrees C
+  float    raw[NUMBER_OF_THERMISTORS][CAL_MAX_POINTS];  // Degrees C
+} CalibrationPoints;
 
+static CalibrationPoints cal_data = {0, CAL_FIT_PIECEWISE, {0.00}, {{0.00}}};
+static bool cal_capturing = false;
 
-void IRQ() {
-  irqFlag = 1;
+/*
+The calibration point being captured in the background, averaged over
+cal_job_samples passes by the scan (cal_samples when the capture started), and
+whether the points are fitted piecewise once it is captured, which is how the
+two-point calibration completes.
+*/
+static uint32_t cal_samples = CAL_DEFAULT_SAMPLES;
+static bool cal_job_active = false;
+static bool cal_job_fit = false;
+static float cal_job_ref = 0;
+static uint32_t cal_job_remaining = 0;
+static uint32_t cal_job_samples = 0;
+
+/*
+Calibration applied to each channel's frames, computed from the calibration
+points above whenever they are loaded or changed.
+*/
+static CalibrationTable cal_table;
+
+static void update_calibration() {
+    ChannelCalibration channel_cal;
+    for (int i = 0; i < NUMBER_OF_THERMISTORS; i++) {
+      if (!calibrated) {
+        calibration_reset(&channel_cal);
+      }
+      else if (!calibration_fit(&channel_cal, cal_data.raw[i], cal_data.ref, cal_data.points, cal_data.fit)) {
+        calibration_reset(&channel_cal);
+        Serial.printf("Thermistor %d calibration points are unusable, left uncalibrated.\n", i + 1);
+      }
+      calibration_table_set(&cal_table, i, &channel_cal);
+    }
 }
 
+/*
+ADC conversion settings for each channel group are stored in EEPROM clear of the
+calibration data. The first byte is ADC_SETTINGS_MAGIC once settings have been saved.
+*/
+#define ADC_SETTINGS_ADDR 512
+#define ADC_SETTINGS_MAGIC 0xA5
 
-bool clear_cal_data() {
+/*
+Filter settings for each channel group follow the ADC settings, with their own
+magic byte.
+*/
+#define FILTER_SETTINGS_ADDR 576
+#define FILTER_SETTINGS_MAGIC 0xA6
+
+/*
+The channel enable mask follows the filter settings, with its own magic byte.
+*/
+#define CHANNEL_MASK_ADDR 640
+#define CHANNEL_MASK_MAGIC 0xA7
+
+/*
+The break-before-make time and the settling time of each channel group follow
+the channel enable mask, with their own magic byte.
+*/
+#define SWITCH_TIMES_ADDR 704
+#define SWITCH_TIMES_MAGIC 0xA9
 
-  EEPROM.write(0, 0x00);
-  eeAddr = 1;
-  mosfetRef = 0;
-  int eeAddr_last = 0;
-
-  //Clear reference temperature values from EEPROM
-  EEPROM.write(eeAddr, 0x00);
-  eeAddr += sizeof(ref_Low); //Move address to the next byte after float 'ref_Low'.
-  EEPROM.write(eeAddr, 0x00);
-  eeAddr += sizeof(ref_High); //Move address to the next byte after float 'ref_High'.
-
-  //Clear raw temperature values from EEPROM
-  while (eeAddr_last < (NUMBER_OF_THERMISTORS * 2)) {
-    EEPROM.write(eeAddr, 0x00);
-    eeAddr += sizeof(raw_Low[mosfetRef]); //Move address to the next byte after float 'raw_Low'.
-    EEPROM.write(eeAddr, 0x00);
-    eeAddr += sizeof(raw_High[mosfetRef]); //Move address to the next byte after float 'raw_High'.
-    eeAddr_last = eeAddr_last + 2;
-    mosfetRef++;
+/*
+The calibration is stored as a single CalibrationRecord, written and read in one
+go, in one of two slots after the settings above. Each save goes to the slot
+not holding the newest record, with the next sequence number, so if the write is
+interrupted the CRC fails and the previous calibration is loaded instead. This
+also spreads the writes over both slots. The magic byte differs from that of
+the multi-point calibration earlier firmware stored at the same address.
+*/
+#define CAL_RECORD_ADDR 1024
+#define CAL_RECORD_MAGIC 0xAA
+#define CAL_RECORD_VERSION 1
+#define CAL_RECORD_SLOTS 2
+
+typedef struct {
+  uint8_t  magic;           // CAL_RECORD_MAGIC
+  uint8_t  version;         // CAL_RECORD_VERSION
+  uint16_t size;            // sizeof(CalibrationRecord)
+  uint32_t sequence;        // Incremented by each save
+  CalibrationPoints points;
+  uint32_t crc;             // CRC-32 of everything above
+} CalibrationRecord;
+
+static_assert(CAL_RECORD_ADDR + CAL_RECORD_SLOTS * sizeof(CalibrationRecord) <= E2END + 1,
+              "Calibration records don't fit in EEPROM");
+
+#define CAL_RECORD_SLOT_ADDR(slot) (CAL_RECORD_ADDR + (slot) * sizeof(CalibrationRecord))
+
+static int cal_slot = -1;               // Slot of the newest record, -1 if none
+static uint32_t cal_sequence = 0;       // Its sequence number
+
+/*
+Calibration saved by earlier firmware: the flag 0x01 at address 0, then the two
+reference temperatures and the pair of raw temperatures of each channel. It is
+converted to a CalibrationRecord at boot.
+*/
+#define LEGACY_CAL_ADDR 0
+#define LEGACY_CAL_FLAG 0x01
+
+/*
+Multi-point calibration saved by earlier firmware: LEGACY_POINTS_MAGIC at
+address 1024, then a CalibrationPoints. It is converted to a CalibrationRecord
+at boot, which overwrites it.
+*/
+#define LEGACY_POINTS_ADDR 1024
+#define LEGACY_POINTS_MAGIC 0xA8
+
+
+/*
+CRC-32 (IEEE 802.3) of a block of bytes, four bits at a time.
+*/
+static uint32_t crc32(const void *data, size_t length) {
+    static const uint32_t table[16] = {
+      0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+      0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+    const uint8_t *byte = (const uint8_t *)data;
+    uint32_t crc = 0xFFFFFFFF;
+    while (length--) {
+      crc = table[(crc ^ *byte) & 0x0F] ^ (crc >> 4);
+      crc = table[(crc ^ (*byte >> 4)) & 0x0F] ^ (crc >> 4);
+      byte++;
+    }
+    return ~crc;
+}
+
+
+static void save_calibration() {
+    CalibrationRecord record;
+    memset(&record, 0, sizeof(record));
+    record.magic = CAL_RECORD_MAGIC;
+    record.version = CAL_RECORD_VERSION;
+    record.size = sizeof(record);
+    record.sequence = cal_sequence + 1;
+    record.points = cal_data;
+    record.crc = crc32(&record, offsetof(CalibrationRecord, crc));
+
+    int slot = (cal_slot + 1) % CAL_RECORD_SLOTS;
+    EEPROM.put(CAL_RECORD_SLOT_ADDR(slot), record);
+    cal_slot = slot;
+    cal_sequence = record.sequence;
+}
+
+
+/*
+Load the newest valid calibration record, or convert the calibration saved by
+earlier firmware: the multi-point calibration, or else the two-point one.
+*/
+static bool load_calibration() {
+    CalibrationRecord record;
+    for (int slot = 0; slot < CAL_RECORD_SLOTS; slot++) {
+      EEPROM.get(CAL_RECORD_SLOT_ADDR(slot), record);
+      if (record.magic != CAL_RECORD_MAGIC || record.version != CAL_RECORD_VERSION ||
+          record.size != sizeof(record) || record.crc != crc32(&record, offsetof(CalibrationRecord, crc)) ||
+          record.points.points < 2 || record.points.points > CAL_MAX_POINTS || record.points.fit >= NUM_CAL_FITS) {
+        continue;
+      }
+      if (cal_slot < 0 || int32_t(record.sequence - cal_sequence) > 0) {
+        cal_data = record.points;
+        cal_slot = slot;
+        cal_sequence = record.sequence;
+      }
+    }
+    if (cal_slot >= 0) {
+      return true;
+    }
+
+    if (EEPROM.read(LEGACY_POINTS_ADDR) == LEGACY_POINTS_MAGIC) {
+      EEPROM.get(LEGACY_POINTS_ADDR + 1, cal_data);
+      if (cal_data.points >= 2 && cal_data.points <= CAL_MAX_POINTS && cal_data.fit < NUM_CAL_FITS) {
+        save_calibration();
+        EEPROM.write(LEGACY_CAL_ADDR, 0x00);
+        Serial.println("Calibration converted to the current format.");
+        return true;
+      }
+      memset(&cal_data, 0, sizeof(cal_data));
+      cal_data.fit = CAL_FIT_PIECEWISE;
+    }
+
+    if (EEPROM.read(LEGACY_CAL_ADDR) != LEGACY_CAL_FLAG) {
+      return false;
+    }
+    float ref[2];
+    float raw[NUMBER_OF_THERMISTORS][2];
+    EEPROM.get(LEGACY_CAL_ADDR + 1, ref);
+    EEPROM.get(LEGACY_CAL_ADDR + 1 + sizeof(ref), raw);
+    cal_data.points = 2;
+    cal_data.fit = CAL_FIT_PIECEWISE;
+    for (int point = 0; point < 2; point++) {
+      cal_data.ref[point] = ref[point];
+      for (mosfetRef = 0; mosfetRef < NUMBER_OF_THERMISTORS; mosfetRef++) {
+        cal_data.raw[mosfetRef][point] = raw[mosfetRef][point];
+      }
+    }
+    save_calibration();
+    EEPROM.write(LEGACY_CAL_ADDR, 0x00);
+    Serial.println("Calibration converted to the current format.");
+    return true;
+}
+
+
+bool clear_cal_data() {
+  //Invalidate every calibration record, and any calibration from earlier firmware.
+  for (int slot = 0; slot < CAL_RECORD_SLOTS; slot++) {
+    EEPROM.write(CAL_RECORD_SLOT_ADDR(slot), 0x00);
   }
+  EEPROM.write(LEGACY_CAL_ADDR, 0x00);
+  cal_slot = -1;
 
   //Clear calibration values from firmware.
-  ref_Low = {0.00};
-  ref_High = {0.00};
-  for( mosfetRef = 0; mosfetRef < NUMBER_OF_THERMISTORS; mosfetRef++){
-    raw_Low[mosfetRef] = {0.00};
-    raw_High[mosfetRef] = {0.00};
+  memset(&cal_data, 0, sizeof(cal_data));
+  cal_data.fit = CAL_FIT_PIECEWISE;
+  cal_capturing = false;
+  if (cal_job_active) {
+    cal_job_active = false;
+    scan_start_capture(0);
+    publish_calibration_progress(false, 0, 0);
   }
   calibrated = false;
+  update_calibration();
+  publish_calibration_points(cal_data.points, cal_data.fit);
   return true;
 }
 
 
 bool cal_thermistor(float ref_temp, int tempNum){
-    eeAddr = 1;
-    irqFlag = 0;
-    Serial.printf("Set temp is %0.2f, calibration begun.\n", ref_temp);
-    setThermistorMuxRead();
-    delay(1);
-    for(int mosfetRef = 0; mosfetRef < NUMBER_OF_THERMISTORS; mosfetRef++) {
-        digitalWrite(mosfet[mosfetRef], HIGH);
-        start_conversion();
-        
-        while (irqFlag == 0) {
-          delay(1); //Wait for interrupt 
-        }
-        irqFlag = 0;
-
-        float raw_temp = read_ADCDATA();
-
-        if (tempNum == 1) {
-          ref_Low = ref_temp;
-          raw_Low[mosfetRef] = raw_temp; 
-          Serial.println("Cal data 1 INW");
-        } 
-        else if (tempNum == 2) {
-          ref_High = ref_temp;
-          raw_High[mosfetRef] = raw_temp;
-          Serial.println("Cal data 2 INW");
-          //raw_Low[mosfetRef] = (ref_High - ref_Low) / (raw_High[mosfetRef] - raw_Low[mosfetRef]);
-         // raw_High[mosfetRef] = raw_High[mosfetRef] - (raw_Low[mosfetRef] * ref_High); 
-
-        }
-        digitalWrite(mosfet[mosfetRef], LOW);
-        
-        if (eeAddr == 1) {
-          EEPROM.put(eeAddr, ref_Low);
-          eeAddr += sizeof(ref_Low); //Move address to the next byte after float 'f'.
-          EEPROM.put(eeAddr, ref_High);
-          eeAddr += sizeof(ref_High); //Move address to the next byte after float 'f'.
-        }
-        Serial.printf("Read thermistor temp = %0.2f Calculated cal value 1 = %0.2f, cal value 2 = %0.2f\n", raw_temp, raw_Low[mosfetRef], raw_High[mosfetRef]);
-        EEPROM.put(eeAddr, raw_Low[mosfetRef]);
-        eeAddr += sizeof(raw_Low[mosfetRef]); //Move address to the next byte after float 'f'.
-        EEPROM.put(eeAddr, raw_High[mosfetRef]);
-        eeAddr += sizeof(raw_High[mosfetRef]); //Move address to the next byte after float 'f'.
-    }
-    Serial.println(eeAddr);
-    
-    if (tempNum == 2) {
-      EEPROM.write(0, 0x01);
-      calibrated = true;
-      Serial.println("Calibration complete.");
-      return true;
+    if ((tempNum != 1 && tempNum != 2) || cal_job_active) {
+      return false;
     }
-    else {
+    //Temperature 1 starts a new set of points and temperature 2 replaces the
+    //second point, then fits the two.
+    cal_capturing = true;
+    cal_data.points = tempNum - 1;
+    if (!cal_capture_point(ref_temp)) {
       return false;
     }
+    cal_job_fit = (tempNum == 2);
+    Serial.printf("Cal data %d INW\n", tempNum);
+    return true;
 }
 
 
-void setup() {
-  //MOSFET digital control I/O ports, set to output. All MOSFETS turned off (pins set to LOW).
-  for (int mosfetRef = 0; mosfetRef < NUMBER_OF_THERMISTORS; mosfetRef++) {
-    pinMode(mosfet[mosfetRef], OUTPUT);  
-    digitalWrite(mosfet[mosfetRef], LOW);
-  }
-  //INW: figure out how to set skew
+/**
+ * @brief Start capturing one point of a multi-point calibration: the raw
+ * temperatures at a known reference temperature, averaged over the calibration
+ * samples.  The capture runs in the background and completes in loop().
+ *
+ * @param ref_temp reference temperature, degrees C
+ * @return true if the capture was started
+ * @return false if a point is already being captured or CAL_MAX_POINTS points
+ * have already been captured
+ */
+bool cal_capture_point(float ref_temp) {
+    if (cal_job_active) {
+      Serial.println("Calibration point already being captured.");
+      return false;
+    }
+    if (!cal_capturing) {
+      cal_data.points = 0;
+      cal_capturing = true;
+    }
+    if (cal_data.points >= CAL_MAX_POINTS) {
+      Serial.println("Calibration points full, fit them or clear the calibration.");
+      return false;
+    }
+    Serial.printf("Set temp is %0.2f, capturing calibration point %lu over %lu samples.\n",
+                  ref_temp, (unsigned long)cal_data.points + 1, (unsigned long)cal_samples);
+    cal_job_active = true;
+    cal_job_fit = false;
+    cal_job_ref = ref_temp;
+    cal_job_samples = cal_samples;
+    cal_job_remaining = cal_job_samples;
+    scan_start_capture(cal_job_samples);
+    publish_calibration_progress(true, 0, 0);
+    return true;
+}
 
-  /*
-  Enable global interrupts. 
-  Set up ADC interrupt feature on teensy pin 23. 
-  Upon recieving an interrupt from ADC(indicating new data is available in ADC),
-  IRQ flag is triggered.
-  */
-  pinMode(INTERRUPT_PIN, INPUT_PULLUP);
-  attachInterrupt(digitalPinToInterrupt(INTERRUPT_PIN), IRQ, FALLING);
-  sei();
-
-  setup_successful = hardwareID_init() && initTeensySPI() && initADC() && network_init();
-  
-  if(setup_successful){
-    Serial.println("Setup successful.");
-    check_brokers();
-  }
-  else {
-    Serial.println("Setup Failed.");
-  }
 
-  if (EEPROM.read(0) == 0x01) {
+/**
+ * @brief Set the number of samples of each channel averaged into a
+ * calibration point, from the next point captured.
+ *
+ * @return true on success
+ * @return false if samples is out of range
+ */
+bool cal_set_samples(uint32_t samples) {
+    if (samples < 1 || samples > CAL_MAX_SAMPLES) {
+      return false;
+    }
+    cal_samples = samples;
+    return true;
+}
+
+
+/*
+Largest standard deviation of a channel over the samples captured so far, the
+noise reported with the progress of a calibration point.
+*/
+static float capture_noise(const ChannelStats *stats) {
+    float noise = 0;
+    for (int i = 0; i < NUMBER_OF_THERMISTORS; i++) {
+      float std_dev = stats_std_dev(&stats[i]);
+      if (std_dev > noise) {
+        noise = std_dev;
+      }
+    }
+    return noise;
+}
+
+
+/*
+Follow the calibration point being captured: publish its progress as each pass
+is captured, and store the point once the capture is complete.
+*/
+static void service_calibration() {
+    if (!cal_job_active) {
+      return;
+    }
+    uint32_t remaining = scan_capture_remaining();
+    if (remaining == cal_job_remaining) {
+      return;
+    }
+    cal_job_remaining = remaining;
+    const ChannelStats *stats = scan_capture_stats();
+    float noise = capture_noise(stats);
+    publish_calibration_progress(remaining != 0, 100.0f * (cal_job_samples - remaining) / cal_job_samples, noise);
+    if (remaining != 0) {
+      return;
+    }
+
+    cal_job_active = false;
+    cal_data.ref[cal_data.points] = cal_job_ref;
+    for (mosfetRef = 0; mosfetRef < NUMBER_OF_THERMISTORS; mosfetRef++) {
+      cal_data.raw[mosfetRef][cal_data.points] = (stats[mosfetRef].count != 0) ? stats[mosfetRef].mean : NAN;
+      Serial.printf("Read thermistor temp = %0.3f, std dev %0.4f over %lu samples\n", cal_data.raw[mosfetRef][cal_data.points],
+                    stats_std_dev(&stats[mosfetRef]), (unsigned long)stats[mosfetRef].count);
+    }
+    cal_data.points++;
+    publish_calibration_points(cal_data.points, cal_data.fit);
+    Serial.printf("Calibration point %lu captured, noise %0.4f °C.\n", (unsigned long)cal_data.points, noise);
+    if (cal_job_fit) {
+      cal_fit_points(CAL_FIT_PIECEWISE);
+    }
+}
+
+
+/**
+ * @brief Fit the captured calibration points, or refit the points of the
+ * calibration in use, and save them to EEPROM.
+ *
+ * @param fit the CalibrationFit
+ * @return true if the calibration was fitted
+ * @return false if the fit is invalid or there are too few points for it
+ */
+bool cal_fit_points(uint32_t fit) {
+    if (cal_job_active || (!cal_capturing && !calibrated)) {
+      return false;
+    }
+    if (fit >= NUM_CAL_FITS || cal_data.points < 2 || cal_data.points < fit + 1) {
+      Serial.println("Invalid calibration fit or too few calibration points.");
+      return false;
+    }
+    cal_data.fit = fit;
+    cal_capturing = false;
     calibrated = true;
-    eeAddr = 1;
-    mosfetRef = 0;
-    int eeAddr_last = 0;
-    if (eeAddr == 1) {
-      EEPROM.get(eeAddr, ref_Low);
-      eeAddr += sizeof(ref_Low); //Move address to the next byte after float 'f'.
-      EEPROM.get(eeAddr, ref_High);
-      eeAddr += sizeof(ref_High); //Move address to the next byte after float 'f'.
-    }
-    while (eeAddr_last < 64) {
-      EEPROM.get(eeAddr, raw_Low[mosfetRef]);
-      eeAddr += sizeof(raw_Low[mosfetRef]); //Move address to the next byte after float 'f'.
-      EEPROM.get(eeAddr, raw_High[mosfetRef]);
-      eeAddr += sizeof(raw_High[mosfetRef]); //Move address to the next byte after float 'f'.
-      eeAddr_last = eeAddr_last + 2;
-      mosfetRef++;
-    }
-    publish_refs(ref_Low, ref_High);
-  }
+    update_calibration();
+    save_calibration();
+    publish_calibration_points(cal_data.points, cal_data.fit);
+    publish_refs(cal_data.ref[0], cal_data.ref[cal_data.points - 1]);
+    publish_calibration_status(true);
+    Serial.println("Calibration complete.");
+    return true;
 }
 
 
-void loop() {
-  int avgCount = 0;
-  float thermistor_temp[NUMBER_OF_THERMISTORS] = {0.00};
-  float ADC_internal_temp = 0;
+bool set_adc_settings(int group, const ADCConversionSettings* settings) {
+    if (!scan_set_group_settings(group, settings)) {
+      return false;
+    }
 
-  check_brokers();
+    //Save the settings for all groups.
+    eeAddr = ADC_SETTINGS_ADDR + 1;
+    for (int g = 0; g < SCAN_CHANNEL_GROUPS; g++) {
+      EEPROM.put(eeAddr, *scan_group_settings(g));
+      eeAddr += sizeof(ADCConversionSettings); //Move address to the next byte after the settings.
+    }
+    EEPROM.write(ADC_SETTINGS_ADDR, ADC_SETTINGS_MAGIC);
+    return true;
+}
 
 
-  //Cycle through mofets; setting digital control pin high, calls on 
-  //function that sets mux register to read thermistor inputs.
-  //Takes average of 5 data values for each mosfet & internal temp, then resets data buffers.
-  while(avgCount < 5) {
-    setThermistorMuxRead();
-    delay(1);
-    for(mosfetRef = 0; mosfetRef < NUMBER_OF_THERMISTORS; mosfetRef++) {
-      digitalWrite(mosfet[mosfetRef], HIGH);
-      start_conversion();
-      
-      while (irqFlag == 0) {
-        delay(1); //Wait for interrupt 
+void load_adc_settings() {
+    if (EEPROM.read(ADC_SETTINGS_ADDR) != ADC_SETTINGS_MAGIC) {
+      return;
+    }
+    eeAddr = ADC_SETTINGS_ADDR + 1;
+    for (int g = 0; g < SCAN_CHANNEL_GROUPS; g++) {
+      ADCConversionSettings settings;
+      EEPROM.get(eeAddr, settings);
+      eeAddr += sizeof(ADCConversionSettings); //Move address to the next byte after the settings.
+      if (!scan_set_group_settings(g, &settings)) {
+        Serial.printf("Invalid ADC settings saved for group %d, using defaults.\n", g + 1);
       }
-      irqFlag = 0;
+    }
+}
 
-    if(thermistor_temp[mosfetRef] == 0.00) {
-        thermistor_temp[mosfetRef] = read_ADCDATA();
-      }
-      else {
-        thermistor_temp[mosfetRef] = (thermistor_temp[mosfetRef] + read_ADCDATA()) / (2); 
+
+bool set_filter_settings(int group, const FilterSettings* settings) {
+    if (!scan_set_group_filter(group, settings)) {
+      return false;
+    }
+
+    //Save the settings for all groups.
+    eeAddr = FILTER_SETTINGS_ADDR + 1;
+    for (int g = 0; g < SCAN_CHANNEL_GROUPS; g++) {
+      EEPROM.put(eeAddr, *scan_group_filter(g));
+      eeAddr += sizeof(FilterSettings); //Move address to the next byte after the settings.
+    }
+    EEPROM.write(FILTER_SETTINGS_ADDR, FILTER_SETTINGS_MAGIC);
+    return true;
+}
+
+
+void load_filter_settings() {
+    if (EEPROM.read(FILTER_SETTINGS_ADDR) != FILTER_SETTINGS_MAGIC) {
+      return;
+    }
+    eeAddr = FILTER_SETTINGS_ADDR + 1;
+    for (int g = 0; g < SCAN_CHANNEL_GROUPS; g++) {
+      FilterSettings settings;
+      EEPROM.get(eeAddr, settings);
+      eeAddr += sizeof(FilterSettings); //Move address to the next byte after the settings.
+      if (!scan_set_group_filter(g, &settings)) {
+        Serial.printf("Invalid filter settings saved for group %d, using defaults.\n", g + 1);
       }
-      digitalWrite(mosfet[mosfetRef], LOW);
     }
-    //Calls on function that sets mux register to read internal ADC temperature. 
-    setADCInternalTempRead();
-    delay(1);
-    start_conversion();
-    
-    while (irqFlag == 0) {
-      delay(1); //Wait for interrupt
+}
+
+
+bool set_channel_enable_mask(uint32_t mask) {
+    if (!scan_set_enable_mask(mask)) {
+      return false;
     }
-    irqFlag = 0;
+    EEPROM.put(CHANNEL_MASK_ADDR + 1, mask);
+    EEPROM.write(CHANNEL_MASK_ADDR, CHANNEL_MASK_MAGIC);
+    return true;
+}
+
 
-    if (ADC_internal_temp == 0) {
-      ADC_internal_temp = read_ADCDATA();
+void load_channel_enable_mask() {
+    if (EEPROM.read(CHANNEL_MASK_ADDR) != CHANNEL_MASK_MAGIC) {
+      return;
     }
-    else {
-      ADC_internal_temp = (ADC_internal_temp + read_ADCDATA()) / (2);
+    uint32_t mask;
+    EEPROM.get(CHANNEL_MASK_ADDR + 1, mask);
+    if (!scan_set_enable_mask(mask)) {
+      Serial.println("Invalid channel enable mask saved, using all channels.");
     }
-    avgCount++;
+}
+
+
+static void save_switch_times() {
+    eeAddr = SWITCH_TIMES_ADDR + 1;
+    EEPROM.put(eeAddr, scan_break_before_make());
+    eeAddr += sizeof(uint32_t); //Move address to the next byte after the time.
+    for (int g = 0; g < SCAN_CHANNEL_GROUPS; g++) {
+      EEPROM.put(eeAddr, scan_group_settle_time(g));
+      eeAddr += sizeof(uint32_t);
+    }
+    EEPROM.write(SWITCH_TIMES_ADDR, SWITCH_TIMES_MAGIC);
+}
+
+
+bool set_break_before_make(uint32_t us) {
+    if (!scan_set_break_before_make(us)) {
+      return false;
+    }
+    save_switch_times();
+    return true;
+}
+
+
+bool set_settle_time(int group, uint32_t us) {
+    if (!scan_set_group_settle_time(group, us)) {
+      return false;
+    }
+    save_switch_times();
+    return true;
+}
+
+
+void load_switch_times() {
+    if (EEPROM.read(SWITCH_TIMES_ADDR) != SWITCH_TIMES_MAGIC) {
+      return;
+    }
+    uint32_t us;
+    eeAddr = SWITCH_TIMES_ADDR + 1;
+    EEPROM.get(eeAddr, us);
+    eeAddr += sizeof(uint32_t); //Move address to the next byte after the time.
+    if (!scan_set_break_before_make(us)) {
+      Serial.println("Invalid break-before-make time saved, using the default.");
+    }
+    for (int g = 0; g < SCAN_CHANNEL_GROUPS; g++) {
+      EEPROM.get(eeAddr, us);
+      eeAddr += sizeof(uint32_t);
+      if (!scan_set_group_settle_time(g, us)) {
+        Serial.printf("Invalid settling time saved for group %d, using the default.\n", g + 1);
+      }
+    }
+}
+
+
+void setup() {
+  //MOSFET control pins and ADC data ready interrupt.
+  scan_init();
+  //INW: figure out how to set skew
+
+  setup_successful = hardwareID_init() && initTeensySPI() && mcp3561.begin() && network_init();
+
+  //ADC and filter settings saved by the user replace the defaults.
+  load_adc_settings();
+  publish_adc_settings();
+  load_filter_settings();
+  publish_filter_settings();
+  load_channel_enable_mask();
+  publish_channel_masks();
+  load_switch_times();
+  publish_switch_times();
+
+  //The calibration is loaded before the birth messages, which report it.
+  calibrated = load_calibration();
+  update_calibration();
+  publish_calibration_status(calibrated);
+  if (calibrated) {
+    publish_refs(cal_data.ref[0], cal_data.ref[cal_data.points - 1]);
+  }
+  publish_calibration_points(cal_data.points, cal_data.fit);
+  
+  if(setup_successful){
+    Serial.println("Setup successful.");
+    check_brokers();
+  }
+  else {
+    Serial.println("Setup Failed.");
+  }
+}
+
+
+void loop() {
+  //Service the network between every step of the acquisition, so incoming
+  //commands never wait for more than a single conversion.
+  check_brokers();
+
+  //Cycle through mofets without waiting; a new frame (average of
+  //SCAN_PASSES_PER_FRAME data values for each mosfet & internal temp) is
+  //ready once every SCAN_PASSES_PER_FRAME passes.
+  bool frame_ready = scan_service();
+  service_calibration();
+  if (!frame_ready) {
+    return;
   }
 
+  float thermistor_temp[NUMBER_OF_THERMISTORS];
+  memcpy(thermistor_temp, scan_thermistor_frame(), sizeof(thermistor_temp));
+  float ADC_internal_temp = scan_adc_temperature();
+  ChannelStats thermistor_stats[NUMBER_OF_THERMISTORS];
+  memcpy(thermistor_stats, scan_thermistor_stats(), sizeof(thermistor_stats));
+
   Serial.printf("Internal ADC temperature: %0.2f °C\n", ADC_internal_temp);
 
   if (calibrated == true) {
+    //Same calibration applied to the statistics, as gain & offset.
+    calibration_apply_frame(&cal_table, thermistor_temp, thermistor_stats);
     for (mosfetRef = 0; mosfetRef < NUMBER_OF_THERMISTORS; mosfetRef++){
-      thermistor_temp[mosfetRef] = (((thermistor_temp[mosfetRef] - raw_Low[mosfetRef]) * (ref_High - ref_Low)) / (raw_High[mosfetRef] - raw_Low[mosfetRef])) + ref_Low;
-      Serial.printf("Thermistor %d temperature: [((raw temp - %0.2f) * (%0.2f - %0.2f)) / (%0.2f - %0.2f)] + %0.2f =  %0.2f °C\n", 
-                    mosfetRef + 1, raw_Low[mosfetRef], ref_High, ref_Low, raw_High[mosfetRef], raw_Low[mosfetRef], ref_Low, thermistor_temp[mosfetRef]);
+      Serial.printf("Thermistor %d calibrated temperature = %0.2f °C\n", mosfetRef + 1, thermistor_temp[mosfetRef]);
     }
   }
   else {
@@ -276,10 +641,15 @@ void loop() {
     }
   }
   Serial.println();
-  publish_data(thermistor_temp, ADC_internal_temp);
+#ifdef MILLICELSIUS_PIPELINE
+  //The published temperatures come from the integer pipeline.
+  int32_t thermistor_mC[NUMBER_OF_THERMISTORS];
+  memcpy(thermistor_mC, scan_thermistor_frame_millicelsius(), sizeof(thermistor_mC));
+  if (calibrated == true) {
+    calibration_apply_frame_millicelsius(&cal_table, thermistor_mC);
+  }
+  publish_data(thermistor_mC, ADC_internal_temp, thermistor_stats);
+#else
+  publish_data(thermistor_temp, ADC_internal_temp, thermistor_stats);
+#endif
 }
-
-
-
-
-
@@ -29,8 +29,23 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #ifndef THERMISTOR_MUX_H
 #define THERMISTOR_MUX_H
 
+#include "command_ADC.h"
+#include "thermistorMux_filter.h"
+
+// Samples of each channel averaged into a calibration point
+#define CAL_DEFAULT_SAMPLES 20
+#define CAL_MAX_SAMPLES 1000
+
 bool cal_thermistor(float set_temp, int tempNum);
+bool cal_capture_point(float ref_temp);
+bool cal_fit_points(uint32_t fit);
+bool cal_set_samples(uint32_t samples);
 bool clear_cal_data();
+bool set_adc_settings(int group, const ADCConversionSettings* settings);
+bool set_filter_settings(int group, const FilterSettings* settings);
+bool set_channel_enable_mask(uint32_t mask);
+bool set_break_before_make(uint32_t us);
+bool set_settle_time(int group, uint32_t us);
 
 #endif
 
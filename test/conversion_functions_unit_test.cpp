@@ -1,6 +1,8 @@
 #include <Arduino.h>
 #include <unity.h>
 #include <command_ADC.h>
+#include <thermistorMux_global.h>
+#include <cf_sparkplug.h>
 
 
 
@@ -11,9 +13,271 @@ void test_negative_inputs(uint32_t data) {
     TEST_ASSERT_EQUAL(x, convert_internal_temp(data));
 }
 
+// Beta equation in double precision, for the reference temperature of a code
+template <class Model>
+double reference_thermistor_temp(uint32_t data) {
+    double ratio = data / 8388608.0;
+    double thermistance = Model::SERIES_RESISTANCE * ratio / (1 - ratio);
+    return 1 / (1 / 298.15 + Model::INVERSE_BETA * log(thermistance / Model::NOMINAL_RESISTANCE)) - 273.15;
+}
+
+// Worst-case error of a model's fast conversion over every positive code,
+// against the reference and against the exact conversion it replaces.
+template <class Model>
+void check_fast_thermistor_conversion_error(void) {
+    double max_error = 0;
+    double max_difference = 0;
+    uint32_t max_error_code = 0;
+    for (uint32_t data = 1; data < 0x00800000; data++) {
+        double reference = reference_thermistor_temp<Model>(data);
+        double fast = Model::temp_fast(data);
+        double difference = fabs(fast - Model::temp_exact(data));
+        if (difference > max_difference) {
+            max_difference = difference;
+        }
+        if (reference > -60 && reference < 150 && fabs(fast - reference) > max_error) {
+            max_error = fabs(fast - reference);
+            max_error_code = data;
+        }
+    }
+    Serial.printf("Fast conversion: worst error %0.5f C at code %lu (-60 to 150 C), worst difference from exact %0.5f C (all codes)\n",
+                  max_error, (unsigned long) max_error_code, max_difference);
+    TEST_ASSERT_TRUE(max_error < 0.01);
+    TEST_ASSERT_TRUE(max_difference < 0.01);
+}
+
+void test_fast_thermistor_conversion_error(void) {
+    check_fast_thermistor_conversion_error<Thermistor10K>();
+}
+
+void test_fast_thermistor_2K_conversion_error(void) {
+    check_fast_thermistor_conversion_error<Thermistor2K>();
+}
+
+// Cycles per conversion for the exact and fast conversions, over codes spread
+// across the full range.
+void benchmark_thermistor_conversion(void) {
+    const uint32_t step = 0x00800000 / 4096;
+    volatile float sink;
+
+    uint32_t start = ARM_DWT_CYCCNT;
+    for (uint32_t data = step; data < 0x00800000; data += step) {
+        sink = Thermistor10K::temp_exact(data);
+    }
+    uint32_t exact_cycles = ARM_DWT_CYCCNT - start;
+
+    start = ARM_DWT_CYCCNT;
+    for (uint32_t data = step; data < 0x00800000; data += step) {
+        sink = Thermistor10K::temp_fast(data);
+    }
+    uint32_t fast_cycles = ARM_DWT_CYCCNT - start;
+    (void) sink;
+
+    Serial.printf("Thermistor conversion: exact %lu cycles, fast %lu cycles\n",
+                  (unsigned long) exact_cycles / 4095, (unsigned long) fast_cycles / 4095);
+    TEST_ASSERT_TRUE(fast_cycles < exact_cycles);
+}
+
+// Fills a frame of codes spread across the full range, with some channels
+// outside the table.
+void fill_frame_codes(uint32_t* codes, uint32_t seed) {
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        codes[channel] = (seed + channel * 0x0003FFFF) & 0x007FFFFF;
+    }
+}
+
+// The batch conversion gives the same result as converting each channel.
+void test_batch_thermistor_conversion(void) {
+    uint32_t codes[NUMBER_OF_THERMISTORS];
+    float temps[NUMBER_OF_THERMISTORS];
+    int32_t millicelsius[NUMBER_OF_THERMISTORS];
+    const uint32_t mask = 0xFFFF7FFF;
+
+    for (uint32_t seed = 1; seed < 0x00800000; seed += 0x1001) {
+        fill_frame_codes(codes, seed);
+        convert_thermistor_batch(codes, mask, temps);
+        convert_thermistor_batch_millicelsius(codes, mask, millicelsius);
+        for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+            if (mask & (1UL << channel)) {
+                TEST_ASSERT_EQUAL_FLOAT(convert_thermistor_temp(channel, codes[channel]), temps[channel]);
+                TEST_ASSERT_EQUAL_INT32(convert_thermistor_millicelsius(channel, codes[channel]), millicelsius[channel]);
+            }
+            else {
+                TEST_ASSERT_TRUE(isnan(temps[channel]));
+                TEST_ASSERT_EQUAL_INT32(THERMISTOR_NO_DATA, millicelsius[channel]);
+            }
+        }
+    }
+}
+
+// A shorted input gives a code of 0, a few codes above it or a negative one;
+// they convert to no temperature, so the scan counts them as faults.
+void test_batch_negative_codes(void) {
+    uint32_t codes[NUMBER_OF_THERMISTORS];
+    float temps[NUMBER_OF_THERMISTORS];
+    int32_t millicelsius[NUMBER_OF_THERMISTORS];
+
+    for (uint32_t seed = 0; seed < 0x00800000; seed += 0x3001) {
+        for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+            //24-bit two's complement codes from 0 down to -0x00800000
+            codes[channel] = 0x00800000 + ((seed + channel * 0x0003FFFF) & 0x007FFFFF);
+        }
+        if (seed == 0) {
+            codes[0] = 0;
+            codes[1] = 1;
+            codes[2] = 5;
+        }
+        convert_thermistor_batch(codes, 0xFFFFFFFF, temps);
+        convert_thermistor_batch_millicelsius(codes, 0xFFFFFFFF, millicelsius);
+        for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+            TEST_ASSERT_TRUE(isnan(temps[channel]));
+            TEST_ASSERT_EQUAL_INT32(THERMISTOR_NO_DATA, millicelsius[channel]);
+        }
+    }
+}
+
+// Cycles per frame for converting each channel and for the batch conversion.
+void benchmark_batch_thermistor_conversion(void) {
+    const int frames = 1024;
+    uint32_t codes[NUMBER_OF_THERMISTORS];
+    volatile float temps[NUMBER_OF_THERMISTORS];
+    float batch_temps[NUMBER_OF_THERMISTORS];
+    uint32_t scalar_cycles = 0;
+    uint32_t batch_cycles = 0;
+
+    for (int frame = 0; frame < frames; frame++) {
+        fill_frame_codes(codes, frame * 0x1F3F);
+
+        uint32_t start = ARM_DWT_CYCCNT;
+        for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+            temps[channel] = convert_thermistor_temp(channel, codes[channel]);
+        }
+        scalar_cycles += ARM_DWT_CYCCNT - start;
+
+        start = ARM_DWT_CYCCNT;
+        convert_thermistor_batch(codes, 0xFFFFFFFF, batch_temps);
+        batch_cycles += ARM_DWT_CYCCNT - start;
+    }
+    (void) temps;
+
+    Serial.printf("Frame conversion: per channel %lu cycles, batch %lu cycles\n",
+                  (unsigned long) scalar_cycles / frames, (unsigned long) batch_cycles / frames);
+    TEST_ASSERT_TRUE(batch_cycles < scalar_cycles);
+}
+
+// A frame of NDATA metrics: the thermistors, the ADC temperature and a count
+#define PAYLOAD_FLOATS (NUMBER_OF_THERMISTORS + 1)
+static float payload_floats[PAYLOAD_FLOATS];
+static uint64_t payload_count;
+static char payload_names[PAYLOAD_FLOATS][16];
+static MetricSpec payload_metrics[PAYLOAD_FLOATS + 1];
+static unsigned long long payload_time = 1700000000000ULL;
+
+unsigned long long payload_timestamp(void) {
+    return payload_time;
+}
+
+void set_up_payload_metrics(void) {
+    for (int i = 0; i < PAYLOAD_FLOATS; i++) {
+        snprintf(payload_names[i], sizeof(payload_names[i]), "Float %d", i);
+        payload_metrics[i] = {payload_names[i], (unsigned) i, false, METRIC_DATA_TYPE_FLOAT, &payload_floats[i], false, 0};
+    }
+    payload_metrics[PAYLOAD_FLOATS] = {"Count", PAYLOAD_FLOATS, false, METRIC_DATA_TYPE_INT64, &payload_count, false, 0};
+    set_gettimestamp_callback(payload_timestamp);
+    TEST_ASSERT_TRUE(check_metrics(payload_metrics, PAYLOAD_FLOATS + 1, PAYLOAD_FLOATS + 1));
+}
+
+// Sets up an NDATA payload for a frame.  The count crosses the varint sizes,
+// and every 100th frame leaves out the count, which changes the metrics.
+void set_up_frame_payload(int frame) {
+    payload_time += 1000;
+    for (int i = 0; i < PAYLOAD_FLOATS; i++) {
+        payload_floats[i] = (frame % 7 == 0 && i == 3) ? NAN : 20 + i * 0.1f + frame * 0.001f;
+        update_metric(payload_metrics, PAYLOAD_FLOATS + 1, &payload_floats[i]);
+    }
+    payload_count = frame * 13 - 200;
+    update_metric(payload_metrics, PAYLOAD_FLOATS + 1, &payload_count);
+    set_up_next_payload();
+    int metrics = (frame % 100 == 50) ? PAYLOAD_FLOATS : PAYLOAD_FLOATS + 1;
+    TEST_ASSERT_TRUE(add_metrics(false, payload_metrics, metrics));
+    payload_metrics[PAYLOAD_FLOATS].updated = false;
+}
+
+// The payload encoded from the template is the same as the nanopb encoding.
+void test_payload_template(void) {
+    static uint8_t encoded[PAYLOAD_TEMPLATE_SIZE];
+    set_up_payload_metrics();
+    for (int frame = 0; frame < 2000; frame++) {
+        set_up_frame_payload(frame);
+        size_t template_length;
+        const uint8_t* from_template = encode_payload_template(&template_length);
+        TEST_ASSERT_NOT_NULL(from_template);
+        size_t length = encode_payload(encoded, sizeof(encoded));
+        TEST_ASSERT_EQUAL_UINT32(length, template_length);
+        TEST_ASSERT_EQUAL_MEMORY(encoded, from_template, length);
+    }
+
+    //Birth payloads have names, so they aren't encoded from a template.
+    set_up_next_payload();
+    TEST_ASSERT_TRUE(add_metrics(true, payload_metrics, PAYLOAD_FLOATS + 1));
+    size_t template_length;
+    TEST_ASSERT_NULL(encode_payload_template(&template_length));
+}
+
+// Cycles per NDATA payload for the nanopb encoding and the template.
+void benchmark_payload_template(void) {
+    const int frames = 1024;
+    static uint8_t encoded[PAYLOAD_TEMPLATE_SIZE];
+    uint32_t nanopb_cycles = 0;
+    uint32_t template_cycles = 0;
+    size_t length;
+
+    set_up_payload_metrics();
+    for (int frame = 1; frame <= frames; frame++) {
+        set_up_frame_payload(frame * 100);
+
+        uint32_t start = ARM_DWT_CYCCNT;
+        length = encode_payload(encoded, sizeof(encoded));
+        nanopb_cycles += ARM_DWT_CYCCNT - start;
+
+        start = ARM_DWT_CYCCNT;
+        encode_payload_template(&length);
+        template_cycles += ARM_DWT_CYCCNT - start;
+    }
+
+    Serial.printf("NDATA payload of %lu bytes: nanopb %lu cycles, template %lu cycles\n", (unsigned long) length,
+                  (unsigned long) nanopb_cycles / frames, (unsigned long) template_cycles / frames);
+    TEST_ASSERT_TRUE(template_cycles < nanopb_cycles);
+}
+
+// A failed check gives back the array's tables, so however often it fails the
+// corrected array can still be checked.
+void test_check_metrics_failure(void) {
+    static float values[2];
+    static MetricSpec metrics[2] = {
+        {"First", 0, false, METRIC_DATA_TYPE_FLOAT, &values[0], false, 0},
+        {"Second", 0, false, METRIC_DATA_TYPE_FLOAT, &values[1], false, 0},
+    };
+    for (int i = 0; i <= MAX_METRIC_ARRAYS; i++) {
+        TEST_ASSERT_FALSE(check_metrics(metrics, 2, 2));
+    }
+    metrics[1].alias = 1;
+    TEST_ASSERT_TRUE(check_metrics(metrics, 2, 2));
+    TEST_ASSERT_EQUAL_PTR(&metrics[1], find_metric_by_alias(metrics, 2, 1));
+}
+
 void setup() {
 
     UNITY_BEGIN();    // IMPORTANT LINE!
+    RUN_TEST(test_fast_thermistor_conversion_error);
+    RUN_TEST(test_fast_thermistor_2K_conversion_error);
+    RUN_TEST(benchmark_thermistor_conversion);
+    RUN_TEST(test_batch_thermistor_conversion);
+    RUN_TEST(test_batch_negative_codes);
+    RUN_TEST(benchmark_batch_thermistor_conversion);
+    RUN_TEST(test_payload_template);
+    RUN_TEST(benchmark_payload_template);
+    RUN_TEST(test_check_metrics_failure);
 
 }
 